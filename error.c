@@ -4,13 +4,28 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 
 #include "error.h"
 
 char fatal_buffer[BUFSIZ];
+__thread FatalTrap *fatal_trap;
+
 void
 fatal_die (int n, const char *str)
 {
+  if (fatal_trap)
+    {
+      size_t len;
+      if (str != fatal_buffer)
+        snprintf (fatal_buffer, sizeof fatal_buffer, "%s", str);
+      len = strlen (fatal_buffer);
+      if (errno)
+        snprintf (fatal_buffer + len, sizeof fatal_buffer - len, ": %s",
+                  strerror (errno));
+      errno = 0;
+      longjmp (fatal_trap->env, 1);
+    }
   fprintf (stderr, "Fatal error: %s\n", str);
   if (errno)
     perror (NULL);
@@ -1,8 +1,21 @@
 /* Error handling */
 #ifndef __error_h
 #define __error_h
+#include <setjmp.h>
 extern char fatal_buffer[BUFSIZ];
 extern void fatal_die (int n, const char *str);
+
+/* While a trap is set on a thread, fatal errors there longjmp to it
+   with the message in fatal_buffer instead of exiting. It's for
+   callers that can recover from code which reports errors with fatal,
+   such as reloading the config. */
+typedef struct FatalTrap FatalTrap;
+struct FatalTrap
+{
+  jmp_buf env;
+  FatalTrap *outer;
+};
+extern __thread FatalTrap *fatal_trap;
 #define fatal(n, s...)                          \
 do                                              \
   {                                             \
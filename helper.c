@@ -0,0 +1,217 @@
+/* ------------------------------------------------------------
+ * Command helpers
+ * A helper is a child process, such as "osascript -i" or a shell,
+ * that runs each command written to its stdin. Starting it once saves
+ * a fork, an exec and the interpreter's start-up on every action.
+ *
+ * After each command the helper is sent its DONE line, which prints
+ * HELPER_DONE_MARK, or the command prints the mark itself when it
+ * finishes. The event loop counts those to see commands complete, and
+ * passes anything else the helper prints to stdout. If the helper
+ * dies, the commands in flight are lost and it is started again for
+ * the next one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "error.h"
+#include "helper.h"
+
+struct CommandHelper
+{
+  Server *server;
+  char *id;
+  char **argv;
+  char *done;
+
+  pid_t pid;                    /* -1 if not running */
+  Connection *in;               /* helper's stdin */
+  Connection *out;              /* helper's stdout */
+  char line[BUFSIZ];            /* partial line of output */
+  int line_len;
+
+  int pending;
+  long starts;
+  long completed;
+  long lost;                    /* in flight when the helper died */
+};
+
+CommandHelper *
+new_command_helper (Server * v, const char *id, char *const argv[],
+                    const char *done)
+{
+  CommandHelper *c = malloc (sizeof *c);
+  int i, n;
+  for (n = 0; argv[n]; n++)
+    ;
+  c->server = v;
+  c->id = strdup (id);
+  c->argv = malloc ((n + 1) * sizeof *c->argv);
+  for (i = 0; i <= n; i++)
+    c->argv[i] = argv[i] ? strdup (argv[i]) : NULL;
+  c->done = done ? strdup (done) : NULL;
+  c->pid = -1;
+  c->in = NULL;
+  c->out = NULL;
+  c->line_len = 0;
+  c->pending = 0;
+  c->starts = 0;
+  c->completed = 0;
+  c->lost = 0;
+  return c;
+}
+
+/* The helper has gone away or stopped talking. Make sure it's dead
+   and forget the commands it had. */
+static void
+command_helper_stop (CommandHelper * c)
+{
+  close (connection_fd (c->in));
+  close (connection_fd (c->out));
+  connection_remove (c->in);
+  connection_remove (c->out);
+  c->in = c->out = NULL;
+  kill (c->pid, SIGKILL);
+  waitpid (c->pid, NULL, 0);
+  errno = 0;
+  c->pid = -1;
+  c->lost += c->pending;
+  c->pending = 0;
+  c->line_len = 0;
+}
+
+/* One complete line of helper output */
+static void
+command_helper_line (CommandHelper * c)
+{
+  c->line[c->line_len] = '\0';
+  if (strstr (c->line, HELPER_DONE_MARK))
+    {
+      if (c->pending > 0)
+        {
+          c->pending--;
+          c->completed++;
+        }
+    }
+  else if (c->line_len)
+    fprintf (stdout, "%s: %s\n", c->id, c->line);
+  c->line_len = 0;
+}
+
+static void
+can_read_helper (Connection * n, void *h)
+{
+  CommandHelper *c = h;
+  char buffer[BUFSIZ];
+  int count, i;
+
+  count = read (connection_fd (n), buffer, sizeof buffer);
+  if (count < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+      errno = 0;
+      return;
+    }
+  if (count <= 0)
+    {
+      warning ("Command helper '%s' exited, %d commands lost\n",
+               c->id, c->pending);
+      command_helper_stop (c);
+      return;
+    }
+  for (i = 0; i < count; i++)
+    {
+      if (buffer[i] == '\n')
+        command_helper_line (c);
+      else
+        {
+          c->line[c->line_len++] = buffer[i];
+          if (c->line_len == sizeof c->line - 1)
+            command_helper_line (c);
+        }
+    }
+}
+
+static void
+write_error_helper (Connection * n, void *h)
+{
+  CommandHelper *c = h;
+  warning ("Can't write to command helper '%s', %d commands lost\n",
+           c->id, c->pending);
+  command_helper_stop (c);
+}
+
+static void
+command_helper_start (CommandHelper * c)
+{
+  int to[2], from[2];
+
+  if (pipe (to) < 0 || pipe (from) < 0)
+    fatal (0, "Couldn't create pipes for command helper '%s'", c->id);
+  c->pid = fork ();
+  if (c->pid == -1)
+    fatal (0, "Couldn't fork command helper '%s'", c->id);
+  if (c->pid == 0)
+    {
+      const char msg[] = "Couldn't exec command helper\n";
+      dup2 (to[0], 0);
+      dup2 (from[1], 1);
+      close (to[0]);
+      close (to[1]);
+      close (from[0]);
+      close (from[1]);
+      execvp (c->argv[0], c->argv);
+      if (write (2, msg, sizeof msg - 1) < 0)
+        ;
+      _exit (127);
+    }
+  close (to[0]);
+  close (from[1]);
+  /* Keep later helpers from holding our ends open */
+  fcntl (to[1], F_SETFD, FD_CLOEXEC);
+  fcntl (from[0], F_SETFD, FD_CLOEXEC);
+  fcntl (to[1], F_SETFL, fcntl (to[1], F_GETFL) | O_NONBLOCK);
+  fcntl (from[0], F_SETFL, fcntl (from[0], F_GETFL) | O_NONBLOCK);
+  c->in = new_connection (c->server, to[1], c->id, c);
+  c->out = new_connection (c->server, from[0], c->id, c);
+  connection_set_can_read (c->out, can_read_helper);
+  connection_set_write_error (c->in, write_error_helper);
+  c->starts++;
+}
+
+void
+command_helper_run (CommandHelper * c, const char *command)
+{
+  if (c->pid == -1)
+    command_helper_start (c);
+  connection_write (c->in, command, strlen (command));
+  connection_write (c->in, "\n", 1);
+  if (c->done)
+    {
+      connection_write (c->in, c->done, strlen (c->done));
+      connection_write (c->in, "\n", 1);
+    }
+  c->pending++;
+}
+
+int
+command_helper_pending (CommandHelper * c)
+{
+  return c->pending;
+}
+
+void
+command_helper_describe (CommandHelper * c, char *buffer)
+{
+  sprintf (buffer, "helper %s: %s pending %d completed %ld starts %ld"
+           " lost %ld\n", c->id, c->pid == -1 ? "stopped" : "running",
+           c->pending, c->completed, c->starts, c->lost);
+}
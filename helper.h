@@ -0,0 +1,29 @@
+/* Command helpers: long-lived child processes that run commands */
+#ifndef __helper_h
+#define __helper_h
+
+#include "server.h"
+
+typedef struct CommandHelper CommandHelper;
+
+/* A helper's DONE line must make it print a line containing this */
+#define HELPER_DONE_MARK "irtoy-helper-done"
+
+/* ARGV runs the helper, which reads commands on stdin. DONE is sent
+   after each command; if it is NULL, each command must print the mark
+   itself. The helper isn't started until it's needed. */
+extern CommandHelper *new_command_helper (Server * v, const char *id,
+                                          char *const argv[],
+                                          const char *done);
+
+/* Send COMMAND to the helper, starting it if it isn't running. Never
+   blocks; completion is noticed by the event loop. */
+extern void command_helper_run (CommandHelper * c, const char *command);
+
+/* Commands sent but not yet done */
+extern int command_helper_pending (CommandHelper * c);
+
+/* One line of counters for ?stats */
+extern void command_helper_describe (CommandHelper * c, char *buffer);
+
+#endif  /* __helper_h */
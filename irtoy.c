@@ -6,271 +6,1946 @@
 #include <termios.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "irtoy.h"
 #include "error.h"
-#include "dict.h"
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define USE_SIMD_X86
+#include <immintrin.h>
+#endif
 
 int irtoy_gap = 8;              /* min gap between packets */
 int irtoy_jitter = 3;           /* acceptable jitter */
+int irtoy_grid = 8;             /* exact match grid, 0 for none */
+
+IRPacket *
+new_irpacket (void)
+{
+  IRPacket *k;
+  k = malloc (sizeof *k);
+  k->n_pulses_allocated = 8;
+  k->n_pulses = 0;
+  k->widths = calloc (k->n_pulses_allocated, sizeof *k->widths);
+  k->n_inline_pulses = 0;
+  k->next_free = NULL;
+  k->early_id = -1;
+  k->early_taken = false;
+  return k;
+}
+
+void
+free_irpacket (IRPacket * k)
+{
+  if (k->widths && !(k->n_inline_pulses && k->widths == k->inline_widths))
+    free (k->widths);
+  free (k);
+}
+
+bool
+irpacket_complete (IRPacket * k)
+{
+  /* XXX Complete the packet */
+  return false;
+}
+
+void
+irpacket_pulse (IRPacket * k, uint16_t width)
+{
+  /* Add a pulse to a packet */
+  if (k->n_pulses_allocated == k->n_pulses)
+    {
+      k->n_pulses_allocated *= 2;
+      if (k->n_inline_pulses && k->widths == k->inline_widths)
+        {
+          /* Spill inline widths to the heap */
+          k->widths = malloc (k->n_pulses_allocated * sizeof *k->widths);
+          memcpy (k->widths, k->inline_widths,
+                  k->n_pulses * sizeof *k->widths);
+        }
+      else
+        k->widths =
+          realloc (k->widths, k->n_pulses_allocated * sizeof *k->widths);
+    }
+  k->widths[k->n_pulses++] = width;
+}
+
+void
+irpacket_printf (FILE * out, IRPacket * k)
+{
+  /* Print it out */
+  int i;
+  if (!k)
+    {
+      fprintf (out, "NULL");
+      return;
+    }
+  fprintf (out, " { ");
+  for (i = 0; i < k->n_pulses; i++)
+    fprintf (out, "%d ", k->widths[i]);
+  fprintf (out, "} ");
+}
+
+void
+irpacket_render (FILE * out, IRPacket * k)
+{
+  int term_width = 78;
+  int total_width;
+  int i, c, x;
+  char *cols;
+  if ((cols = getenv("COLUMNS")))
+    {
+      term_width = atoi(cols);
+    }
+  total_width = 0;
+  for (i = 0; i < k->n_pulses; i++)
+    total_width += k->widths[i];
+  c = 0;
+  x = 0;
+  for (i = 0; i < k->n_pulses; i++)
+    {
+      x += k->widths[i];
+      while (c < 1.0 * x * term_width / total_width)
+        {
+          c++;
+          if (IRPULSE_MARK (i))
+            fputc ('|', out);
+          else
+            fputc ('_', out);
+        }
+    }
+}
+
+/* Read a packet from IN a line at a time, so IN may be a terminal */
+IRPacket *
+irpacket_scanf (FILE * in)
+{
+  char *text = NULL, *line = NULL;
+  size_t len = 0, line_size = 0;
+  ssize_t n;
+  Lexer *lx;
+  IRPacket *k;
+
+  while ((n = getline (&line, &line_size, in)) > 0)
+    {
+      text = realloc (text, len + n);
+      memcpy (text + len, line, n);
+      len += n;
+      if (memchr (line, '}', n))
+        break;
+    }
+  free (line);
+  lx = new_lexer ("stdin", text ? text : "", len);
+  k = irpacket_lex (lx);
+  lexer_close (lx);
+  free (text);
+  return k;
+}
+
+/* A packet, "{ <width>... }", or NULL at the end of LX */
+IRPacket *
+irpacket_lex (Lexer * lx)
+{
+  Token t;
+  if (!lexer_next (lx, &t))
+    return NULL;
+  if (!token_is (&t, "{"))
+    lexer_fatal (lx, &t, "Malformed packet: expected '{', got '%.*s'",
+                 t.len, t.text);
+  return irpacket_lex_widths (lx);
+}
+
+/* Read the rest of a packet, after its '{' */
+IRPacket *
+irpacket_lex_widths (Lexer * lx)
+{
+  IRPacket *k = new_irpacket ();
+  Token t;
+
+  for (;;)
+    {
+      long long width;
+      lexer_expect (lx, &t, "width or '}'");
+      if (token_is (&t, "}"))
+        break;
+      width = lexer_integer (lx, &t, 10);
+      if (width < 0 || width > 0xffff)
+        lexer_fatal (lx, &t, "Malformed packet: expected short int or '}',"
+                     " got '%.*s'", t.len, t.text);
+      irpacket_pulse (k, width);
+    }
+  irpacket_complete (k);
+  return k;
+}
+
+/* ------------------------------------------------------------
+ * Protocol decoding
+ * Packets in the common consumer protocols are decoded to a code, so
+ * a button is one code rather than a handful of raw captures. Toggle
+ * bits are dropped, so every press of a button gives the same code.
+ * Nominal timings are in usecs; IRToy samples are 21.33 usecs.
+ */
+
+#define IRTOY_TICKS(usecs) (((usecs) * 3 + 32) / 64)
+#define IRTOY_USECS(ticks) (((ticks) * 64 + 1) / 3)
+
+static const char *irprotocol_names[] = {
+  "raw", "nec", "samsung", "jvc", "kaseikyo", "sirc12", "sirc15", "sirc20",
+  "rc5", "rc6", NULL
+};
+
+/* Pulse distance protocols: bits are a fixed mark and a short (0) or
+   long (1) space, least significant bit first, then a closing mark */
+typedef struct IRDistanceProtocol IRDistanceProtocol;
+struct IRDistanceProtocol
+{
+  int protocol;
+  int header_mark, header_space;
+  int mark, zero_space, one_space;
+  int bits;
+};
+
+static const IRDistanceProtocol irdistance_protocols[] = {
+  {irproto_nec, 9000, 4500, 560, 560, 1690, 32},
+  {irproto_samsung, 4500, 4500, 560, 560, 1690, 32},
+  {irproto_jvc, 8400, 4200, 526, 526, 1578, 16},
+  {irproto_kaseikyo, 3456, 1728, 432, 432, 1296, 48},
+};
+
+#define N_DISTANCE_PROTOCOLS \
+  (sizeof irdistance_protocols / sizeof irdistance_protocols[0])
+
+#define SIRC_UNIT 600
+#define RC5_UNIT 889
+#define RC6_UNIT 444
+#define IRDECODE_MAX_LEVELS 64
+
+const char *
+irprotocol_name (int protocol)
+{
+  if (protocol < 0 || protocol >= irproto_count)
+    return NULL;
+  return irprotocol_names[protocol];
+}
+
+/* Protocol called NAME, or -1 */
+int
+irprotocol_lookup (const char *name)
+{
+  int i;
+  for (i = 0; irprotocol_names[i]; i++)
+    if (!strcasecmp (irprotocol_names[i], name))
+      return i;
+  return -1;
+}
+
+/* Is a pulse of WIDTH ticks within tolerance of USECS? */
+static bool
+irdecode_near (int width, int usecs)
+{
+  int nominal = IRTOY_TICKS (usecs);
+  return abs (width - nominal) <= nominal / 4 + 2;
+}
+
+static bool
+irdecode_distance (const IRPacket * k, const IRDistanceProtocol * p,
+                   bool header, uint64_t * data)
+{
+  int i, bit;
+  const uint16_t *w = k->widths;
+  if (k->n_pulses != (header ? 2 : 0) + 2 * p->bits + 1)
+    return false;
+  if (header)
+    {
+      if (!irdecode_near (w[0], p->header_mark)
+          || !irdecode_near (w[1], p->header_space))
+        return false;
+      w += 2;
+    }
+  *data = 0;
+  for (bit = 0, i = 0; bit < p->bits; bit++, i += 2)
+    {
+      if (!irdecode_near (w[i], p->mark))
+        return false;
+      if (irdecode_near (w[i + 1], p->one_space))
+        *data |= (uint64_t) 1 << bit;
+      else if (!irdecode_near (w[i + 1], p->zero_space))
+        return false;
+    }
+  return irdecode_near (w[i], p->mark);
+}
+
+/* Sony: the bit is in the mark width, least significant first */
+static bool
+irdecode_sirc (const IRPacket * k, IRCode * code)
+{
+  int i, bits = (k->n_pulses - 1) / 2;
+  uint32_t data = 0;
+  switch (bits)
+    {
+    case 12:
+      code->protocol = irproto_sirc12;
+      break;
+    case 15:
+      code->protocol = irproto_sirc15;
+      break;
+    case 20:
+      code->protocol = irproto_sirc20;
+      break;
+    default:
+      return false;
+    }
+  if (!irdecode_near (k->widths[0], 4 * SIRC_UNIT)
+      || !irdecode_near (k->widths[1], SIRC_UNIT))
+    return false;
+  for (i = 0; i < bits; i++)
+    {
+      int mark = k->widths[2 + 2 * i];
+      if (irdecode_near (mark, 2 * SIRC_UNIT))
+        data |= 1 << i;
+      else if (!irdecode_near (mark, SIRC_UNIT))
+        return false;
+      if (i + 1 < bits && !irdecode_near (k->widths[3 + 2 * i], SIRC_UNIT))
+        return false;
+    }
+  code->command = data & 0x7f;
+  code->address = data >> 7;
+  return true;
+}
+
+/* Expand the pulses of K from FIRST into half-bit levels of UNIT usecs,
+   after the PREFIX levels already in LEVELS. Returns the number of
+   levels, or -1 if a pulse isn't a whole number of units. */
+static int
+irdecode_levels (const IRPacket * k, int first, int unit, int max_units,
+                 uint8_t * levels, int prefix)
+{
+  int i, n = prefix;
+  for (i = first; i < k->n_pulses; i++)
+    {
+      int usecs = IRTOY_USECS (k->widths[i]);
+      int units = (usecs + unit / 2) / unit;
+      if (units < 1 || units > max_units
+          || abs (usecs - units * unit) > unit * 35 / 100
+          || n + units > IRDECODE_MAX_LEVELS)
+        return -1;
+      while (units--)
+        levels[n++] = IRPULSE_MARK (i);
+    }
+  return n;
+}
+
+/* RC5: 14 Manchester bits, 1 = space then mark. Start, field (an
+   inverted 7th command bit), toggle, 5 address and 6 command bits. */
+static bool
+irdecode_rc5 (const IRPacket * k, IRCode * code)
+{
+  uint8_t levels[IRDECODE_MAX_LEVELS];
+  uint32_t data = 0;
+  int i, n;
+  levels[0] = 0;                /* start bit's space is idle */
+  n = irdecode_levels (k, 0, RC5_UNIT, 2, levels, 1);
+  if (n == 27)
+    levels[n++] = 0;            /* last bit's space is the gap */
+  if (n != 28)
+    return false;
+  for (i = 0; i < 14; i++)
+    {
+      if (levels[2 * i] == levels[2 * i + 1])
+        return false;
+      data = data << 1 | levels[2 * i + 1];
+    }
+  if (!(data & 0x2000))
+    return false;
+  code->protocol = irproto_rc5;
+  code->address = (data >> 6) & 0x1f;
+  code->command = (data & 0x3f) | (data & 0x1000 ? 0 : 0x40);
+  return true;
+}
+
+/* RC6 mode 0: a 6 unit mark and 2 unit space, then Manchester bits
+   with 1 = mark then space: start, 3 mode bits, a double width toggle,
+   8 address and 8 command bits */
+static bool
+irdecode_rc6 (const IRPacket * k, IRCode * code)
+{
+  uint8_t levels[IRDECODE_MAX_LEVELS];
+  uint32_t data = 0;
+  int i, n;
+  if (k->n_pulses < 3 || !irdecode_near (k->widths[0], 6 * RC6_UNIT)
+      || !irdecode_near (k->widths[1], 2 * RC6_UNIT))
+    return false;
+  n = irdecode_levels (k, 2, RC6_UNIT, 3, levels, 0);
+  if (n == 43)
+    levels[n++] = 0;
+  if (n != 44)
+    return false;
+  /* Start bit and mode 0 */
+  if (levels[0] != 1 || levels[1] != 0)
+    return false;
+  for (i = 2; i < 8; i += 2)
+    if (levels[i] != 0 || levels[i + 1] != 1)
+      return false;
+  /* Toggle: two units each half */
+  if (levels[8] != levels[9] || levels[10] != levels[11]
+      || levels[8] == levels[10])
+    return false;
+  for (i = 12; i < 44; i += 2)
+    {
+      if (levels[i] == levels[i + 1])
+        return false;
+      data = data << 1 | levels[i];
+    }
+  code->protocol = irproto_rc6;
+  code->address = data >> 8;
+  code->command = data & 0xff;
+  return true;
+}
+
+/* Decode K to CODE. Returns false if it's in no known protocol. */
+bool
+irpacket_decode (const IRPacket * k, IRCode * code)
+{
+  unsigned i;
+  uint64_t data;
+  for (i = 0; i < N_DISTANCE_PROTOCOLS; i++)
+    {
+      const IRDistanceProtocol *p = &irdistance_protocols[i];
+      /* JVC only sends the header on the first frame */
+      if (!irdecode_distance (k, p, true, &data)
+          && !(p->protocol == irproto_jvc
+               && irdecode_distance (k, p, false, &data)))
+        continue;
+      code->protocol = p->protocol;
+      switch (p->protocol)
+        {
+        case irproto_nec:
+        case irproto_samsung:
+          /* Plain NEC has inverted copies of 8 bit address and
+             command; extended NEC uses them for 16 bit ones */
+          code->address = data & 0xffff;
+          if (((data >> 8) & 0xff) == (~data & 0xff))
+            code->address &= 0xff;
+          code->command = (data >> 16) & 0xffff;
+          if (((data >> 24) & 0xff) == (~(data >> 16) & 0xff))
+            code->command &= 0xff;
+          break;
+        case irproto_jvc:
+          code->address = data & 0xff;
+          code->command = data >> 8;
+          break;
+        case irproto_kaseikyo:
+          code->address = data & 0xffff;  /* vendor */
+          code->command = data >> 16;
+          break;
+        }
+      return true;
+    }
+  return irdecode_sirc (k, code) || irdecode_rc5 (k, code)
+    || irdecode_rc6 (k, code);
+}
+
+/* Append runs of LEVELS, UNIT usecs each, to K as pulses. Leading and
+   trailing spaces are idle time, so are left off. */
+static void
+irencode_levels (IRPacket * k, const uint8_t * levels, int n, int unit)
+{
+  int i = 0, run;
+  while (i < n && !levels[i])
+    i++;
+  while (n > i && !levels[n - 1])
+    n--;
+  while (i < n)
+    {
+      for (run = 1; i + run < n && levels[i + run] == levels[i]; run++)
+        ;
+      irpacket_pulse (k, IRTOY_TICKS (run * unit));
+      i += run;
+    }
+}
+
+static void
+irencode_manchester (uint8_t * levels, int *n, uint32_t data, int bits,
+                     bool one_rises)
+{
+  while (bits--)
+    {
+      int bit = (data >> bits) & 1;
+      levels[(*n)++] = one_rises ? !bit : bit;
+      levels[(*n)++] = one_rises ? bit : !bit;
+    }
+}
+
+/* A packet that decodes to CODE, with nominal timings, or NULL if the
+   protocol is unknown */
+IRPacket *
+ircode_packet (const IRCode * code)
+{
+  IRPacket *k;
+  uint8_t levels[IRDECODE_MAX_LEVELS];
+  int i, n = 0;
+  uint64_t data;
+
+  k = new_irpacket ();
+  switch (code->protocol)
+    {
+    case irproto_nec:
+    case irproto_samsung:
+    case irproto_jvc:
+    case irproto_kaseikyo:
+      {
+        const IRDistanceProtocol *p = NULL;
+        for (i = 0; i < (int) N_DISTANCE_PROTOCOLS; i++)
+          if (irdistance_protocols[i].protocol == code->protocol)
+            p = &irdistance_protocols[i];
+        switch (code->protocol)
+          {
+          case irproto_jvc:
+            data = (code->address & 0xff) | (code->command & 0xff) << 8;
+            break;
+          case irproto_kaseikyo:
+            data = (code->address & 0xffff)
+              | (uint64_t) code->command << 16;
+            break;
+          default:
+            data = code->address > 0xff ? code->address & 0xffff
+              : code->address | (~code->address & 0xff) << 8;
+            data |= (uint64_t) (code->command > 0xff
+                                ? code->command & 0xffff
+                                : code->command
+                                | (~code->command & 0xff) << 8) << 16;
+            break;
+          }
+        irpacket_pulse (k, IRTOY_TICKS (p->header_mark));
+        irpacket_pulse (k, IRTOY_TICKS (p->header_space));
+        for (i = 0; i < p->bits; i++)
+          {
+            irpacket_pulse (k, IRTOY_TICKS (p->mark));
+            irpacket_pulse (k, IRTOY_TICKS ((data >> i) & 1 ? p->one_space
+                                            : p->zero_space));
+          }
+        irpacket_pulse (k, IRTOY_TICKS (p->mark));
+        break;
+      }
+    case irproto_sirc12:
+    case irproto_sirc15:
+    case irproto_sirc20:
+      {
+        int bits = code->protocol == irproto_sirc12 ? 12
+          : code->protocol == irproto_sirc15 ? 15 : 20;
+        data = (code->command & 0x7f) | (uint64_t) code->address << 7;
+        irpacket_pulse (k, IRTOY_TICKS (4 * SIRC_UNIT));
+        for (i = 0; i < bits; i++)
+          {
+            irpacket_pulse (k, IRTOY_TICKS (SIRC_UNIT));
+            irpacket_pulse (k, IRTOY_TICKS ((data >> i) & 1 ? 2 * SIRC_UNIT
+                                            : SIRC_UNIT));
+          }
+        break;
+      }
+    case irproto_rc5:
+      data = 0x2000 | (code->command & 0x40 ? 0 : 0x1000)
+        | (code->address & 0x1f) << 6 | (code->command & 0x3f);
+      irencode_manchester (levels, &n, data, 14, true);
+      irencode_levels (k, levels, n, RC5_UNIT);
+      break;
+    case irproto_rc6:
+      for (i = 0; i < 6; i++)
+        levels[n++] = 1;
+      levels[n++] = 0;
+      levels[n++] = 0;
+      irencode_manchester (levels, &n, 0x8, 4, false);  /* start, mode 0 */
+      levels[n++] = 0;          /* toggle 0 */
+      levels[n++] = 0;
+      levels[n++] = 1;
+      levels[n++] = 1;
+      irencode_manchester (levels, &n, (code->address & 0xff) << 8
+                           | (code->command & 0xff), 16, false);
+      irencode_levels (k, levels, n, RC6_UNIT);
+      break;
+    default:
+      free_irpacket (k);
+      return NULL;
+    }
+  return k;
+}
+
+/* ------------------------------------------------------------
+ * Capture files
+ * A binary capture is a 16 byte header followed by records, all in
+ * the writer's byte order and padded to 8 bytes so the widths can be
+ * used in place:
+ *
+ *   header:  "IRTOYCAP", u16 version, u16 0x0102, u32 0
+ *   record:  u32 length, u16 type, u16 tag, u64 timestamp, payload
+ *
+ * A packet record's payload is LENGTH u16 widths. A tag record's
+ * payload is the LENGTH byte name of tag number TAG; tags are defined
+ * before they're used. Packets without a tag have tag IRCAP_NO_TAG,
+ * and timestamps (usecs since the epoch) are 0 if not known.
+ */
+
+#define IRCAP_MAGIC "IRTOYCAP"
+#define IRCAP_VERSION 1
+#define IRCAP_BOM 0x0102
+#define IRCAP_HEADER_LEN 16
+#define IRCAP_RECORD_LEN 16
+#define IRCAP_PACKET 1
+#define IRCAP_TAGNAME 2
+#define IRCAP_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+struct IRCaptureRecord
+{
+  uint32_t length;
+  uint16_t type;
+  uint16_t tag;
+  uint64_t timestamp;
+};
+
+/* Find or add tag NAME, LEN bytes long */
+static int
+ircapture_tag (IRCapture * c, const char *name, size_t len)
+{
+  int i;
+  for (i = 0; i < c->n_tags; i++)
+    if (strlen (c->tags[i]) == len && !memcmp (c->tags[i], name, len))
+      return i;
+  if (c->n_tags == IRCAP_NO_TAG)
+    fatal (0, "%s: too many tags", c->fname);
+  c->tags = realloc (c->tags, (c->n_tags + 1) * sizeof *c->tags);
+  c->tags[c->n_tags] = strndup (name, len);
+  return c->n_tags++;
+}
+
+IRCapture *
+ircapture_open (const char *file)
+{
+  IRCapture *c;
+  struct stat st;
+  int fd = open (file, O_RDONLY);
+  if (fd < 0)
+    fatal (0, "Can't open capture file '%s'", file);
+  if (fstat (fd, &st))
+    fatal (0, "Can't stat capture file '%s'", file);
+  c = calloc (1, sizeof *c);
+  c->fname = strdup (file);
+  c->size = st.st_size;
+  if (c->size)
+    {
+      c->map = mmap (NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (c->map == MAP_FAILED)
+        fatal (0, "Can't map capture file '%s'", file);
+      madvise (c->map, c->size, MADV_SEQUENTIAL);
+    }
+  close (fd);
+  c->packet = calloc (1, sizeof *c->packet);
+  c->tag = IRCAP_NO_TAG;
+
+  if (c->size >= IRCAP_HEADER_LEN && !memcmp (c->map, IRCAP_MAGIC, 8))
+    {
+      uint16_t version, bom;
+      memcpy (&version, c->map + 8, sizeof version);
+      memcpy (&bom, c->map + 10, sizeof bom);
+      if (bom != IRCAP_BOM)
+        fatal (0, "%s: capture written with another byte order", file);
+      if (version != IRCAP_VERSION)
+        fatal (0, "%s: unknown capture version %d", file, version);
+      c->binary = true;
+      c->pos = IRCAP_HEADER_LEN;
+    }
+  else
+    c->lexer = new_lexer (file, c->size ? (char *) c->map : "", c->size);
+  return c;
+}
+
+void
+ircapture_close (IRCapture * c)
+{
+  int i;
+  if (c->lexer)
+    lexer_close (c->lexer);
+  if (c->size)
+    munmap (c->map, c->size);
+  for (i = 0; i < c->n_tags; i++)
+    free (c->tags[i]);
+  free (c->tags);
+  free (c->text_widths);
+  free (c->packet);
+  free ((char *) c->fname);
+  free (c);
+}
+
+static IRPacket *
+ircapture_next_binary (IRCapture * c)
+{
+  for (;;)
+    {
+      struct IRCaptureRecord r;
+      size_t payload;
+      if (c->pos == c->size)
+        return NULL;
+      if (c->size - c->pos < IRCAP_RECORD_LEN)
+        fatal (0, "%s: truncated record at offset %zu", c->fname, c->pos);
+      memcpy (&r, c->map + c->pos, sizeof r);
+      c->pos += IRCAP_RECORD_LEN;
+      payload = r.type == IRCAP_PACKET ? r.length * sizeof (uint16_t)
+        : r.length;
+      if (c->size - c->pos < payload)
+        fatal (0, "%s: truncated record at offset %zu", c->fname, c->pos);
+
+      switch (r.type)
+        {
+        case IRCAP_PACKET:
+          if (r.tag != IRCAP_NO_TAG && r.tag >= c->n_tags)
+            fatal (0, "%s: undefined tag %d at offset %zu", c->fname,
+                   r.tag, c->pos);
+          c->packet->widths = (uint16_t *) (c->map + c->pos);
+          c->packet->n_pulses = r.length;
+          c->tag = r.tag;
+          c->timestamp = r.timestamp;
+          break;
+        case IRCAP_TAGNAME:
+          if (r.tag != c->n_tags
+              || ircapture_tag (c, (char *) c->map + c->pos, r.length)
+              != r.tag)
+            fatal (0, "%s: bad tag definition at offset %zu", c->fname,
+                   c->pos);
+          break;
+        default:
+          /* Skip records from later versions */
+          break;
+        }
+      if (c->size - c->pos < IRCAP_ALIGN (payload))
+        c->pos = c->size;
+      else
+        c->pos += IRCAP_ALIGN (payload);
+      if (r.type == IRCAP_PACKET)
+        return c->packet;
+    }
+}
+
+/* Text captures: "{ 43 40 ... }" per packet, optionally preceded by
+   "key <tag>" and then "@<timestamp>" as in the out_file log. '#'
+   comments run to the end of the line. A packet with a bad width, or
+   cut short by the next '{', is skipped with a warning: logs of real
+   sessions have them. */
+
+/* The widths of a packet after its '{', into C's packet. False if
+   the packet was malformed and has been skipped. */
+static bool
+ircapture_text_widths (IRCapture * c)
+{
+  Token t;
+  int n_pulses = 0;
+  bool bad = false;
+  for (;;)
+    {
+      long long width;
+      if (!lexer_next (c->lexer, &t))
+        break;                  /* unterminated at the end of the file */
+      if (token_is (&t, "}"))
+        break;
+      if (token_is (&t, "{"))
+        {
+          lexer_warning (c->lexer, &t, "unterminated packet, skipped");
+          n_pulses = 0;
+          bad = false;
+          continue;
+        }
+      if (bad)
+        continue;
+      if (!token_integer (&t, 10, &width) || width < 0 || width > 0xffff)
+        {
+          lexer_warning (c->lexer, &t, "malformed packet: expected short"
+                         " int or '}', got '%.*s', skipped", t.len, t.text);
+          bad = true;
+          continue;
+        }
+      if (n_pulses == c->text_allocated)
+        {
+          c->text_allocated = c->text_allocated ? 2 * c->text_allocated : 64;
+          c->text_widths = realloc (c->text_widths, c->text_allocated
+                                    * sizeof *c->text_widths);
+        }
+      c->text_widths[n_pulses++] = width;
+    }
+  c->packet->widths = c->text_widths;
+  c->packet->n_pulses = n_pulses;
+  return !bad;
+}
+
+static IRPacket *
+ircapture_next_text (IRCapture * c)
+{
+  Token t;
+
+  do
+    {
+      if (!lexer_next (c->lexer, &t))
+        return NULL;
+      c->tag = IRCAP_NO_TAG;
+      c->timestamp = 0;
+      if (token_is (&t, "key"))
+        {
+          lexer_expect (c->lexer, &t, "tag");
+          c->tag = ircapture_tag (c, t.text, t.len);
+          lexer_expect (c->lexer, &t, "'{'");
+        }
+      if (t.len > 1 && t.text[0] == '@' && !t.quoted)
+        {
+          Token number = t;
+          long long timestamp;
+          number.text++;
+          number.len--;
+          timestamp = lexer_integer (c->lexer, &number, 10);
+          if (timestamp < 0)
+            lexer_fatal (c->lexer, &t, "malformed timestamp '%.*s'",
+                         t.len, t.text);
+          c->timestamp = timestamp;
+          lexer_expect (c->lexer, &t, "'{'");
+        }
+      if (!token_is (&t, "{"))
+        lexer_fatal (c->lexer, &t, "malformed packet: expected '{', got"
+                     " '%.*s'", t.len, t.text);
+    }
+  while (!ircapture_text_widths (c));
+  return c->packet;
+}
+
+/* The next packet, or NULL at the end. The packet belongs to C and
+   lasts until the next call, or for binary captures, until C is
+   closed. */
+IRPacket *
+ircapture_next (IRCapture * c)
+{
+  if (c->binary)
+    return ircapture_next_binary (c);
+  return ircapture_next_text (c);
+}
+
+static void
+ircapture_write_record (FILE * out, int type, int tag, uint64_t timestamp,
+                        const void *payload, size_t length, size_t size)
+{
+  static const unsigned char zeros[8];
+  struct IRCaptureRecord r;
+  r.length = length;
+  r.type = type;
+  r.tag = tag;
+  r.timestamp = timestamp;
+  fwrite (&r, sizeof r, 1, out);
+  fwrite (payload, 1, size, out);
+  fwrite (zeros, 1, IRCAP_ALIGN (size) - size, out);
+}
+
+void
+ircapture_write_header (FILE * out)
+{
+  unsigned char header[IRCAP_HEADER_LEN] = IRCAP_MAGIC;
+  uint16_t version = IRCAP_VERSION, bom = IRCAP_BOM;
+  memcpy (header + 8, &version, sizeof version);
+  memcpy (header + 10, &bom, sizeof bom);
+  fwrite (header, sizeof header, 1, out);
+}
+
+void
+ircapture_write_tag (FILE * out, int tag, const char *name)
+{
+  ircapture_write_record (out, IRCAP_TAGNAME, tag, 0, name, strlen (name),
+                          strlen (name));
+}
+
+void
+ircapture_write_packet (FILE * out, IRPacket * k, int tag,
+                        uint64_t timestamp)
+{
+  ircapture_write_record (out, IRCAP_PACKET, tag, timestamp, k->widths,
+                          k->n_pulses, k->n_pulses * sizeof *k->widths);
+}
+
+/* ------------------------------------------------------------
+ * Width comparison kernels
+ * Two runs of N widths match at JITTER if every pair of widths is
+ * within JITTER, and so are the two totals. The distance between two
+ * runs is the smallest jitter at which they match. Vector versions
+ * are picked at runtime; IRTOY_KERNEL=scalar forces the plain ones.
+ */
+
+static bool
+irwidths_match_scalar (const uint16_t *a, const uint16_t *b, int n,
+                       int jitter)
+{
+  int i, total = 0;
+  for (i = 0; i < n; i++)
+    {
+      int d = a[i] - b[i];
+      if (abs (d) > jitter)
+        return false;
+      total += d;
+    }
+  return abs (total) <= jitter;
+}
+
+static int
+irwidths_distance_scalar (const uint16_t *a, const uint16_t *b, int n)
+{
+  int i, total = 0, max = 0;
+  for (i = 0; i < n; i++)
+    {
+      int d = a[i] - b[i];
+      if (abs (d) > max)
+        max = abs (d);
+      total += d;
+    }
+  return abs (total) > max ? abs (total) : max;
+}
+
+#ifdef USE_SIMD_X86
+/* |a - b| per lane is subs(a, b) | subs(b, a). The signed difference
+   of the totals is accumulated in 32-bit lanes. */
+
+__attribute__ ((target ("sse2")))
+static bool
+irwidths_match_sse2 (const uint16_t *a, const uint16_t *b, int n,
+                     int jitter)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i j = _mm_set1_epi16 ((short) jitter);
+  __m128i sum = zero;
+  int32_t lanes[4];
+  int i, total;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m128i va = _mm_loadu_si128 ((const __m128i *) (a + i));
+      __m128i vb = _mm_loadu_si128 ((const __m128i *) (b + i));
+      __m128i d = _mm_or_si128 (_mm_subs_epu16 (va, vb),
+                                _mm_subs_epu16 (vb, va));
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (_mm_subs_epu16 (d, j), zero))
+          != 0xffff)
+        return false;
+      sum = _mm_add_epi32 (sum, _mm_sub_epi32 (_mm_unpacklo_epi16 (va, zero),
+                                               _mm_unpacklo_epi16 (vb, zero)));
+      sum = _mm_add_epi32 (sum, _mm_sub_epi32 (_mm_unpackhi_epi16 (va, zero),
+                                               _mm_unpackhi_epi16 (vb, zero)));
+    }
+  _mm_storeu_si128 ((__m128i *) lanes, sum);
+  total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  for (; i < n; i++)
+    {
+      int d = a[i] - b[i];
+      if (abs (d) > jitter)
+        return false;
+      total += d;
+    }
+  return abs (total) <= jitter;
+}
+
+__attribute__ ((target ("sse2")))
+static int
+irwidths_distance_sse2 (const uint16_t *a, const uint16_t *b, int n)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i sum = zero, max = zero;
+  int32_t lanes[4];
+  uint16_t maxes[8];
+  int i, total, m = 0;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m128i va = _mm_loadu_si128 ((const __m128i *) (a + i));
+      __m128i vb = _mm_loadu_si128 ((const __m128i *) (b + i));
+      __m128i d = _mm_or_si128 (_mm_subs_epu16 (va, vb),
+                                _mm_subs_epu16 (vb, va));
+      /* No unsigned 16-bit max in SSE2: max(m, d) = subs(m, d) + d */
+      max = _mm_adds_epu16 (_mm_subs_epu16 (max, d), d);
+      sum = _mm_add_epi32 (sum, _mm_sub_epi32 (_mm_unpacklo_epi16 (va, zero),
+                                               _mm_unpacklo_epi16 (vb, zero)));
+      sum = _mm_add_epi32 (sum, _mm_sub_epi32 (_mm_unpackhi_epi16 (va, zero),
+                                               _mm_unpackhi_epi16 (vb, zero)));
+    }
+  _mm_storeu_si128 ((__m128i *) lanes, sum);
+  _mm_storeu_si128 ((__m128i *) maxes, max);
+  total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  for (i = 0; i < 8; i++)
+    if (maxes[i] > m)
+      m = maxes[i];
+  for (i = n & ~7; i < n; i++)
+    {
+      int d = a[i] - b[i];
+      if (abs (d) > m)
+        m = abs (d);
+      total += d;
+    }
+  return abs (total) > m ? abs (total) : m;
+}
+
+__attribute__ ((target ("avx2")))
+static bool
+irwidths_match_avx2 (const uint16_t *a, const uint16_t *b, int n,
+                     int jitter)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i j = _mm256_set1_epi16 ((short) jitter);
+  __m256i sum = zero;
+  int32_t lanes[8];
+  int i, k, total = 0;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      __m256i va = _mm256_loadu_si256 ((const __m256i *) (a + i));
+      __m256i vb = _mm256_loadu_si256 ((const __m256i *) (b + i));
+      __m256i d = _mm256_or_si256 (_mm256_subs_epu16 (va, vb),
+                                   _mm256_subs_epu16 (vb, va));
+      if (_mm256_movemask_epi8 (_mm256_cmpeq_epi16
+                                (_mm256_subs_epu16 (d, j), zero)) != -1)
+        return false;
+      sum = _mm256_add_epi32 (sum,
+                              _mm256_sub_epi32 (_mm256_unpacklo_epi16 (va, zero),
+                                                _mm256_unpacklo_epi16 (vb, zero)));
+      sum = _mm256_add_epi32 (sum,
+                              _mm256_sub_epi32 (_mm256_unpackhi_epi16 (va, zero),
+                                                _mm256_unpackhi_epi16 (vb, zero)));
+    }
+  _mm256_storeu_si256 ((__m256i *) lanes, sum);
+  for (k = 0; k < 8; k++)
+    total += lanes[k];
+  for (; i < n; i++)
+    {
+      int d = a[i] - b[i];
+      if (abs (d) > jitter)
+        return false;
+      total += d;
+    }
+  return abs (total) <= jitter;
+}
+
+__attribute__ ((target ("avx2")))
+static int
+irwidths_distance_avx2 (const uint16_t *a, const uint16_t *b, int n)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i sum = zero, max = zero;
+  int32_t lanes[8];
+  uint16_t maxes[16];
+  int i, total = 0, m = 0;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      __m256i va = _mm256_loadu_si256 ((const __m256i *) (a + i));
+      __m256i vb = _mm256_loadu_si256 ((const __m256i *) (b + i));
+      __m256i d = _mm256_or_si256 (_mm256_subs_epu16 (va, vb),
+                                   _mm256_subs_epu16 (vb, va));
+      max = _mm256_max_epu16 (max, d);
+      sum = _mm256_add_epi32 (sum,
+                              _mm256_sub_epi32 (_mm256_unpacklo_epi16 (va, zero),
+                                                _mm256_unpacklo_epi16 (vb, zero)));
+      sum = _mm256_add_epi32 (sum,
+                              _mm256_sub_epi32 (_mm256_unpackhi_epi16 (va, zero),
+                                                _mm256_unpackhi_epi16 (vb, zero)));
+    }
+  _mm256_storeu_si256 ((__m256i *) lanes, sum);
+  _mm256_storeu_si256 ((__m256i *) maxes, max);
+  for (i = 0; i < 8; i++)
+    total += lanes[i];
+  for (i = 0; i < 16; i++)
+    if (maxes[i] > m)
+      m = maxes[i];
+  for (i = n & ~15; i < n; i++)
+    {
+      int d = a[i] - b[i];
+      if (abs (d) > m)
+        m = abs (d);
+      total += d;
+    }
+  return abs (total) > m ? abs (total) : m;
+}
+#endif  /* USE_SIMD_X86 */
+
+static bool (*irwidths_match_kernel) (const uint16_t *a, const uint16_t *b,
+                                      int n, int jitter);
+static int (*irwidths_distance_kernel) (const uint16_t *a,
+                                        const uint16_t *b, int n);
+/* Analysis and decode threads may all get here first */
+static pthread_once_t irwidths_kernels_once = PTHREAD_ONCE_INIT;
+
+static void
+irwidths_select_kernels (void)
+{
+  const char *kernel = getenv ("IRTOY_KERNEL");
+  irwidths_match_kernel = irwidths_match_scalar;
+  irwidths_distance_kernel = irwidths_distance_scalar;
+  if (kernel && !strcmp (kernel, "scalar"))
+    return;
+#ifdef USE_SIMD_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2")
+      && !(kernel && !strcmp (kernel, "sse2")))
+    {
+      irwidths_match_kernel = irwidths_match_avx2;
+      irwidths_distance_kernel = irwidths_distance_avx2;
+    }
+  else if (__builtin_cpu_supports ("sse2"))
+    {
+      irwidths_match_kernel = irwidths_match_sse2;
+      irwidths_distance_kernel = irwidths_distance_sse2;
+    }
+#endif
+}
+
+/* Do A and B, each N widths long, match at JITTER? */
+static bool
+irwidths_match (const uint16_t *a, const uint16_t *b, int n, int jitter)
+{
+  if (jitter < 0)
+    return false;
+  if (jitter > 0xffff)
+    jitter = 0xffff;
+  pthread_once (&irwidths_kernels_once, irwidths_select_kernels);
+  return irwidths_match_kernel (a, b, n, jitter);
+}
+
+/* Do two packets match? The total packet time should also fit into
+   the allowed jitter: it's not cumulative. */
+bool
+irpacket_match (IRPacket * a, IRPacket * b, int jitter)
+{
+  if (a->n_pulses != b->n_pulses)
+    return false;
+  return irwidths_match (a->widths, b->widths, a->n_pulses, jitter);
+}
+
+/* Smallest jitter at which two packets match, or -1 if they never
+   can (different numbers of pulses). */
+int
+irpacket_min_jitter (IRPacket * a, IRPacket * b)
+{
+  if (a->n_pulses != b->n_pulses)
+    return -1;
+  pthread_once (&irwidths_kernels_once, irwidths_select_kernels);
+  return irwidths_distance_kernel (a->widths, b->widths, a->n_pulses);
+}
+
+/* ------------------------------------------------------------
+ * Pulse width clusters
+ * Protocols build their pulses from a few unit widths, so a width
+ * histogram is a set of peaks, smeared by jitter. The histogram is
+ * smoothed to bridge odd empty bins, cut into runs of populated bins,
+ * and each run is split again at its deepest valley, as long as the
+ * peaks either side of it are much higher, until none is left.
+ */
+
+#define IRCLUSTER_VALLEY 4      /* peaks must be this much above a valley */
+
+static void
+irclusters_split (IRClusters * c, const int *counts, const int *smooth,
+                  int lo, int hi)
+{
+  int i, valley = -1, peak = 0, valley_peak = 0;
+  int *right_peak;
+  IRCluster *cl;
+
+  /* The valley whose lower neighbouring peak stands highest above it */
+  right_peak = malloc ((hi - lo + 2) * sizeof *right_peak);
+  right_peak[hi - lo + 1] = 0;
+  for (i = hi; i >= lo; i--)
+    right_peak[i - lo] = smooth[i] > right_peak[i - lo + 1]
+      ? smooth[i] : right_peak[i - lo + 1];
+  for (i = lo + 1; i < hi; i++)
+    {
+      int p;
+      if (smooth[i - 1] > peak)
+        peak = smooth[i - 1];
+      p = peak < right_peak[i + 1 - lo] ? peak : right_peak[i + 1 - lo];
+      if (smooth[i] * IRCLUSTER_VALLEY < p
+          && (valley < 0 || (long) p * smooth[valley]
+              > (long) smooth[i] * valley_peak))
+        {
+          valley = i;
+          valley_peak = p;
+        }
+    }
+  free (right_peak);
+  if (valley >= 0)
+    {
+      irclusters_split (c, counts, smooth, lo, valley);
+      irclusters_split (c, counts, smooth, valley + 1, hi);
+      return;
+    }
+
+  /* Trim smoothing spill from the ends */
+  while (lo < hi && !counts[lo])
+    lo++;
+  while (hi > lo && !counts[hi])
+    hi--;
+  if (!counts[lo])
+    return;
+
+  c->clusters = realloc (c->clusters,
+                         (c->n_clusters + 1) * sizeof *c->clusters);
+  cl = &c->clusters[c->n_clusters++];
+  cl->lo = lo;
+  cl->hi = hi;
+  cl->count = 0;
+  {
+    long sum = 0;
+    for (i = lo; i <= hi; i++)
+      {
+        cl->count += counts[i];
+        sum += (long) i * counts[i];
+      }
+    cl->centre = (sum + cl->count / 2) / cl->count;
+  }
+
+  /* Spread: half-width around the centre holding 99% of the pulses */
+  {
+    int within = counts[cl->centre];
+    cl->spread = 0;
+    while (within * 100L < cl->count * 99L)
+      {
+        cl->spread++;
+        if (cl->centre - cl->spread >= lo)
+          within += counts[cl->centre - cl->spread];
+        if (cl->centre + cl->spread <= hi)
+          within += counts[cl->centre + cl->spread];
+      }
+  }
+}
+
+/* Cluster the widths 0..MAX_WIDTH, COUNTS[w] of each */
+IRClusters *
+irclusters_from_histogram (const int *counts, int max_width)
+{
+  IRClusters *c = calloc (1, sizeof *c);
+  int *smooth = calloc (max_width + 1, sizeof *smooth);
+  int i, lo = -1;
+
+  for (i = 0; i <= max_width; i++)
+    smooth[i] = (i > 0 ? counts[i - 1] : 0) + 2 * counts[i]
+      + (i < max_width ? counts[i + 1] : 0);
+  for (i = 0; i <= max_width + 1; i++)
+    {
+      bool populated = i <= max_width && smooth[i];
+      if (populated && lo < 0)
+        lo = i;
+      else if (!populated && lo >= 0)
+        {
+          irclusters_split (c, counts, smooth, lo, i - 1);
+          lo = -1;
+        }
+    }
+  free (smooth);
+  return c;
+}
+
+void
+free_irclusters (IRClusters * c)
+{
+  free (c->clusters);
+  free (c);
+}
+
+/* Index of the cluster nearest WIDTH, or -1 if there are none */
+int
+irclusters_classify (const IRClusters * c, int width)
+{
+  int lo = 0, hi = c->n_clusters - 1;
+  if (hi < 0)
+    return -1;
+  /* Last cluster starting at or below WIDTH */
+  while (lo < hi)
+    {
+      int mid = (lo + hi + 1) / 2;
+      if (c->clusters[mid].lo <= width)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+  if (width > c->clusters[lo].hi && lo + 1 < c->n_clusters
+      && c->clusters[lo + 1].centre - width < width - c->clusters[lo].centre)
+    lo++;
+  return lo;
+}
+
+/* Jitter that covers the spread of every cluster, but no more than
+   keeps neighbouring centres apart */
+int
+irclusters_jitter (const IRClusters * c)
+{
+  int i, jitter = 0;
+  for (i = 0; i < c->n_clusters; i++)
+    if (c->clusters[i].spread > jitter)
+      jitter = c->clusters[i].spread;
+  for (i = 1; i < c->n_clusters; i++)
+    {
+      int limit = (c->clusters[i].centre - c->clusters[i - 1].centre - 1) / 2;
+      if (jitter > limit)
+        jitter = limit;
+    }
+  return jitter;
+}
+
+/* Cluster index of each of K's pulses into OUT. 255 means no cluster
+   (or one past 254), so check it against C's n_clusters before use. */
+void
+irpacket_quantize (const IRPacket * k, const IRClusters * c, uint8_t * out)
+{
+  int i;
+  for (i = 0; i < k->n_pulses; i++)
+    {
+      int n = irclusters_classify (c, k->widths[i]);
+      out[i] = n < 0 || n > UINT8_MAX ? UINT8_MAX : n;
+    }
+}
+
+/* ------------------------------------------------------------
+ * Dict/Symbol handling
+ * Names are interned to small integer ids, which is what packet
+ * lookups return. Packet lookups go through a matcher index which is
+ * rebuilt on the first lookup after an insert.
+ */
+
+IRDict *
+new_irdict (void)
+{
+  IRDict *d = malloc (sizeof *d);
+  d->first = NULL;
+  d->n_symbols = 0;
+  d->id_slots = NULL;
+  d->n_id_slots = 0;
+  d->names = NULL;
+  d->transmit = NULL;
+  d->n_names = 0;
+  d->n_names_allocated = 0;
+  d->index_valid = false;
+  d->n_buckets = 0;
+  d->buckets = NULL;
+  d->widths = NULL;
+  d->generation = 0;
+  d->n_trie_nodes = 0;
+  d->trie = NULL;
+  d->n_code_slots = 0;
+  d->code_slots = NULL;
+  d->grid = 0;
+  d->jitter = 0;
+  d->n_grid_slots = 0;
+  d->grid_slots = NULL;
+  d->code_hits = d->grid_hits = d->slow_lookups = d->slow_hits = 0;
+  return d;
+}
+
+static void irdict_free_index (IRDict * d);
+
+/* Free D and its symbols. If OWNS_DATA, the names and packet widths
+   given to irdict_insert and friends are freed too; otherwise they
+   belong to the caller, such as a mapped cache. */
+void
+free_irdict (IRDict * d, bool owns_data)
+{
+  IRSymbol *s, *next;
+  int i;
+  for (s = d->first; s; s = next)
+    {
+      next = s->next;
+      for (i = 0; i < s->n_frames; i++)
+        if (s->frames[i])
+          {
+            free (s->frames[i]->data);
+            free (s->frames[i]);
+          }
+      free (s->frames);
+      if (owns_data)
+        {
+          free ((char *) s->name);
+          free_irpacket (s->packet);
+        }
+      else
+        free (s->packet);
+      free (s);
+    }
+  irdict_free_index (d);
+  for (i = 0; i < d->n_names; i++)
+    free ((char *) d->names[i]);
+  free (d->names);
+  free (d->transmit);
+  free (d->id_slots);
+  free (d);
+}
+
+static unsigned
+irname_hash (const char *name)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *name; name++)
+    h = (h ^ (unsigned char) *name) * 0x100000001b3ULL;
+  return h ^ h >> 32;
+}
+
+/* Slot for NAME: its id + 1, or the empty slot it would go in */
+static int *
+irdict_id_slot (IRDict * d, const char *name)
+{
+  unsigned mask = d->n_id_slots - 1;
+  unsigned i = irname_hash (name) & mask;
+  while (d->id_slots[i] && strcmp (d->names[d->id_slots[i] - 1], name))
+    i = (i + 1) & mask;
+  return &d->id_slots[i];
+}
+
+/* The id of NAME, or -1 if it has never been interned */
+int
+irdict_name_id (IRDict * d, const char *name)
+{
+  return d->n_id_slots ? *irdict_id_slot (d, name) - 1 : -1;
+}
+
+/* The id of NAME, giving it the next one if it's new */
+int
+irdict_intern (IRDict * d, const char *name)
+{
+  int id = irdict_name_id (d, name);
+  if (id >= 0)
+    return id;
+  if (d->n_names == d->n_names_allocated)
+    {
+      d->n_names_allocated = d->n_names_allocated
+        ? 2 * d->n_names_allocated : 64;
+      d->names = realloc (d->names,
+                          d->n_names_allocated * sizeof *d->names);
+      d->transmit = realloc (d->transmit,
+                             d->n_names_allocated * sizeof *d->transmit);
+    }
+  if (2 * (d->n_names + 1) > d->n_id_slots)
+    {
+      /* Keep it at most half full */
+      int i;
+      free (d->id_slots);
+      d->n_id_slots = d->n_id_slots ? 2 * d->n_id_slots : 128;
+      d->id_slots = calloc (d->n_id_slots, sizeof *d->id_slots);
+      for (i = 0; i < d->n_names; i++)
+        *irdict_id_slot (d, d->names[i]) = i + 1;
+    }
+  id = d->n_names++;
+  d->names[id] = strdup (name);
+  d->transmit[id] = NULL;
+  *irdict_id_slot (d, name) = id + 1;
+  return id;
+}
+
+const char *
+irdict_name (IRDict * d, int id)
+{
+  return id >= 0 && id < d->n_names ? d->names[id] : NULL;
+}
+
+/* Find the symbol used for transmitting name ID */
+IRSymbol *
+irdict_id_symbol (IRDict * d, int id)
+{
+  return id >= 0 && id < d->n_names ? d->transmit[id] : NULL;
+}
+
+IRSymbol *
+irdict_lookup_symbol (IRDict * d, const char *name)
+{
+  return irdict_id_symbol (d, irdict_name_id (d, name));
+}
+
+/* Find a symbol (any symbol) for this name.
+ */
+IRPacket *
+irdict_lookup_name (IRDict * d, const char *name)
+{
+  IRSymbol *s = irdict_lookup_symbol (d, name);
+  if (s)
+    return s->packet;
+  else
+    return NULL;
+}
+
+/* Encode K, sent REPEATS times, as an IRToy transmit frame. Repeats
+   are separated by a space long enough for a receiver to see a gap
+   between packets. */
+static IRFrame *
+irpacket_encode_frame (IRPacket * k, int repeats)
+{
+  IRFrame *f = malloc (sizeof *f);
+  unsigned char *b;
+  int r, i;
+  int last = k->n_pulses ? k->widths[k->n_pulses - 1] : 0;
+  int gap = (irtoy_gap + 1) * last;
+  if (gap > 0xfffe)
+    gap = 0xfffe;
+
+  /* Command byte, pulses plus one gap per repeat, terminator */
+  f->len = 1 + repeats * 2 * (k->n_pulses + 1) + 2;
+  f->data = malloc (f->len);
+  b = f->data;
+  *b++ = 3;                     /* start transmission */
+  for (r = 0; r < repeats; r++)
+    {
+      for (i = 0; i < k->n_pulses; i++)
+        {
+          int width = k->widths[i];
+          /* A packet that ends on a space gets that space stretched
+             into the gap instead */
+          if (r < repeats - 1 && i == k->n_pulses - 1
+              && !IRPULSE_MARK (i) && width < gap)
+            width = gap;
+          *b++ = width >> 8;    /* high byte */
+          *b++ = width & 0xff;  /* low byte */
+        }
+      if (r < repeats - 1 && k->n_pulses && IRPULSE_MARK (k->n_pulses - 1))
+        {
+          *b++ = gap >> 8;
+          *b++ = gap & 0xff;
+        }
+    }
+  *b++ = 0xff;
+  *b++ = 0xff;
+  f->len = b - f->data;
+  return f;
+}
 
-IRPacket *
-new_irpacket (void)
+/* The transmit frame for S repeated REPEATS times. Frames are built
+   once and kept with the symbol. */
+const IRFrame *
+irsymbol_frame (IRSymbol * s, int repeats)
 {
-  IRPacket *k;
-  k = malloc (sizeof *k);
-  k->n_pulses_allocated = 8;
-  k->n_pulses = 0;
-  k->pulses = calloc (k->n_pulses_allocated, sizeof *k->pulses);
-  return k;
+  if (repeats < 1)
+    repeats = 1;
+  if (repeats > s->n_frames)
+    {
+      s->frames = realloc (s->frames, repeats * sizeof *s->frames);
+      memset (s->frames + s->n_frames, '\0',
+              (repeats - s->n_frames) * sizeof *s->frames);
+      s->n_frames = repeats;
+    }
+  if (!s->frames[repeats - 1])
+    s->frames[repeats - 1] = irpacket_encode_frame (s->packet, repeats);
+  return s->frames[repeats - 1];
 }
 
-void
-free_irpacket (IRPacket * k)
+static int
+irpacket_total (IRPacket * k)
 {
-  if (k->pulses)
-    free (k->pulses);
-  free (k);
+  int i, total = 0;
+  for (i = 0; i < k->n_pulses; i++)
+    total += k->widths[i];
+  return total;
 }
 
-bool
-irpacket_complete (IRPacket * k)
+static int
+irindexentry_compare (const void *a, const void *b)
 {
-  /* XXX Complete the packet */
-  return false;
+  const IRIndexEntry *ea = a, *eb = b;
+  if (ea->total != eb->total)
+    return ea->total - eb->total;
+  /* Most recently inserted first, as in the symbol list */
+  return eb->symbol->serial - ea->symbol->serial;
 }
 
-void
-irpacket_pulse (IRPacket * k, IRPulse pulse)
+static void
+irdict_free_index (IRDict * d)
 {
-  /* Add a pulse to a packet */
-  if (k->n_pulses_allocated == k->n_pulses)
-    {
-      k->n_pulses_allocated *= 2;
-      k->pulses =
-        realloc (k->pulses, k->n_pulses_allocated * sizeof *k->pulses);
-    }
-  k->pulses[k->n_pulses++] = pulse;
+  int i;
+  for (i = 0; i < d->n_buckets; i++)
+    free (d->buckets[i].entries);
+  free (d->buckets);
+  free (d->widths);
+  free (d->code_slots);
+  free (d->grid_slots);
+  free (d->trie);
+  d->buckets = NULL;
+  d->widths = NULL;
+  d->trie = NULL;
+  d->n_trie_nodes = 0;
+  d->code_slots = NULL;
+  d->grid_slots = NULL;
+  d->n_buckets = 0;
+  d->n_code_slots = 0;
+  d->n_grid_slots = 0;
+  d->index_valid = false;
 }
 
-void
-irpacket_printf (FILE * out, IRPacket * k)
+/* Widths snapped to the nearest multiple of GRID */
+#define IRGRID(w, grid) (((w) + (grid) / 2) / (grid))
+
+static unsigned
+irwidths_grid_hash (const uint16_t * w, int n, int grid)
 {
-  /* Print it out */
+  uint64_t h = 0xcbf29ce484222325ULL ^ n;
   int i;
-  bool expected_value = true;
-  if (!k)
-    {
-      fprintf (out, "NULL");
-      return;
-    }
-  fprintf (out, " { ");
-  for (i = 0; i < k->n_pulses; i++)
+  for (i = 0; i < n; i++)
+    h = (h ^ IRGRID (w[i], grid)) * 0x100000001b3ULL;
+  return h ^ h >> 32;
+}
+
+/* Slot for the widths W: the entry with the same snapped widths, or
+   the empty slot it would go in */
+static IRIndexEntry **
+irdict_grid_slot (IRDict * d, const uint16_t * w, int n)
+{
+  unsigned mask = d->n_grid_slots - 1;
+  unsigned i = irwidths_grid_hash (w, n, d->grid) & mask;
+  for (;; i = (i + 1) & mask)
     {
-#if 0
-      if (k->pulses[i].value != expected_value)
-        fatal (0, "Unexpected pulse value: pulse %d (of %d) has value %d",
-               i, k->n_pulses, k->pulses[i].value);
-#endif
-      fprintf (out, "%d ", k->pulses[i].width);
-      expected_value = !expected_value;
+      IRIndexEntry *e = d->grid_slots[i];
+      int j;
+      if (!e)
+        break;
+      if (e->symbol->packet->n_pulses != n)
+        continue;
+      for (j = 0; j < n; j++)
+        if (IRGRID (e->widths[j], d->grid) != IRGRID (w[j], d->grid))
+          break;
+      if (j == n)
+        break;
     }
-  fprintf (out, "} ");
+  return &d->grid_slots[i];
 }
 
-void
-irpacket_decode (IRPacket * k)
+static unsigned
+ircode_hash (const IRCode * code)
+{
+  uint64_t h = code->protocol;
+  h = (h * 0x9e3779b97f4a7c15ULL) ^ code->address;
+  h = (h * 0x9e3779b97f4a7c15ULL) ^ code->command;
+  h *= 0x9e3779b97f4a7c15ULL;
+  return h >> 32;
+}
+
+static bool
+ircode_equal (const IRCode * a, const IRCode * b)
+{
+  return a->protocol == b->protocol && a->address == b->address
+    && a->command == b->command;
+}
+
+/* Slot for CODE: the symbol with it, or the empty slot it would go in */
+static IRSymbol **
+irdict_code_slot (IRDict * d, const IRCode * code)
+{
+  unsigned i = ircode_hash (code) & (d->n_code_slots - 1);
+  while (d->code_slots[i] && !ircode_equal (&d->code_slots[i]->code, code))
+    i = (i + 1) & (d->n_code_slots - 1);
+  return &d->code_slots[i];
+}
+
+/* Order symbols by their widths, a prefix before its extensions */
+static int
+irsymbol_widths_compare (const void *a, const void *b)
 {
-#define IMUL(x, f) (((int)(512 * (f)) * x ) / 512)
+  const IRPacket *ka = (*(IRSymbol * const *) a)->packet;
+  const IRPacket *kb = (*(IRSymbol * const *) b)->packet;
   int i;
-  int packet_len = 0;
-  int min_width = 0;
-  int max_bits = 0;
-  int min_bits = 0;
-  int min_res = 2;              /* minimum resolution of +/- 2 */
-  const double proportional_error = 1.1;
-  
-  for (i = 0; i < k->n_pulses; i++)
-    {
-      packet_len += k->pulses[i].width;
-      if (k->pulses[i].width < min_width || min_width == 0)
-        min_width = k->pulses[i].width;
-    }
+  for (i = 0; i < ka->n_pulses && i < kb->n_pulses; i++)
+    if (ka->widths[i] != kb->widths[i])
+      return ka->widths[i] - kb->widths[i];
+  return ka->n_pulses - kb->n_pulses;
+}
 
-  printf("Decode packet: "); irpacket_printf(stdout, k);
-  printf("\n"); irpacket_render(stdout, k);
-  printf("\nMinimum pulse width = %d, total packet time = %d\n",
-         min_width, packet_len);
+/* Fill in trie node NODE for the N sorted symbols S, which share
+   their first DEPTH widths, and recurse for its children. */
+static void
+irdict_build_trie (IRDict * d, int node, IRSymbol ** s, int n, int depth)
+{
+  IRTrieNode *t = &d->trie[node];
+  int i, j, child;
 
-  /* Minimum number of bits: there *must* be at least as many bits as
-     there were pulses. Also, the minimum size of a pulse might set a
-     lower bound: a pulse can be at most one bit wide, give or take. */
-  if (IMUL(min_width, 0.9) > 0)
-    min_bits = packet_len / (IMUL(min_width, 0.9));
-  else
-    min_bits = packet_len;
-  
-  printf("First guess at min bits: %d (by min pulse width)\n", min_bits);
-  if (min_bits < k->n_pulses)
+  t->terminal = NULL;
+  t->id = n ? s[0]->id : -1;
+  t->n_children = 0;
+  for (i = 0; i < n; i++)
     {
-      printf("Number of bits must be at least number of pulses, so %d\n",
-             k->n_pulses);
-      min_bits = k->n_pulses;
+      if (t->id != s[i]->id)
+        t->id = -1;
+      if (s[i]->packet->n_pulses == depth)
+        {
+          if (!t->terminal || t->terminal->serial < s[i]->serial)
+            t->terminal = s[i];
+        }
+      else if (i == 0 || s[i - 1]->packet->n_pulses == depth
+               || s[i - 1]->packet->widths[depth]
+               != s[i]->packet->widths[depth])
+        t->n_children++;
     }
-  /* Maximum bits: our minimum resolution is +/- 3. If bits are any
-     smaller than that, we stand no chance of recognising them. */
-  max_bits = packet_len / (2 * min_res);
-  printf("Can only fit %d bits (of min size %d) in %d time.\n",
-         max_bits, 2*min_res, packet_len);
 
-  printf("Packet has somewhere between %d and %d bits.\n", min_bits, max_bits);
-
-#undef IMUL
+  /* Symbols ending here sort first; the rest group by next width */
+  child = t->first_child = d->n_trie_nodes;
+  d->n_trie_nodes += t->n_children;
+  for (i = 0; i < n && s[i]->packet->n_pulses == depth; i++)
+    ;
+  for (; i < n; i = j)
+    {
+      uint16_t w = s[i]->packet->widths[depth];
+      for (j = i; j < n && s[j]->packet->widths[depth] == w; j++)
+        ;
+      d->trie[child].width = w;
+      d->trie[child].total = t->total + w;
+      irdict_build_trie (d, child++, s + i, j - i, depth + 1);
+    }
 }
 
-void
-irpacket_render (FILE * out, IRPacket * k)
+/* Rebuild the matcher index from the symbol list */
+static void
+irdict_build_index (IRDict * d)
 {
-  int term_width = 78;
-  int total_width;
-  int i, c, x;
-  char *cols;
-  if ((cols = getenv("COLUMNS")))
+  IRSymbol *s;
+  int i, j, n_widths = 0;
+  uint16_t *w;
+
+  irdict_free_index (d);
+  for (s = d->first; s; s = s->next)
+    if (s->packet->n_pulses >= d->n_buckets)
+      d->n_buckets = s->packet->n_pulses + 1;
+  d->buckets = calloc (d->n_buckets, sizeof *d->buckets);
+
+  /* Count, allocate, then fill */
+  for (s = d->first; s; s = s->next)
+    d->buckets[s->packet->n_pulses].n_entries++;
+  for (i = 0; i < d->n_buckets; i++)
     {
-      term_width = atoi(cols);
+      IRIndexBucket *b = &d->buckets[i];
+      if (b->n_entries)
+        b->entries = malloc (b->n_entries * sizeof *b->entries);
+      b->n_entries = 0;
     }
-  total_width = 0;
-  for (i = 0; i < k->n_pulses; i++)
-    total_width += k->pulses[i].width;
-  c = 0;
-  x = 0;
-  for (i = 0; i < k->n_pulses; i++)
+  for (s = d->first; s; s = s->next)
     {
-      x += k->pulses[i].width;
-      while (c < 1.0 * x * term_width / total_width)
+      IRIndexBucket *b = &d->buckets[s->packet->n_pulses];
+      IRIndexEntry *e = &b->entries[b->n_entries++];
+      e->total = irpacket_total (s->packet);
+      e->symbol = s;
+    }
+  for (i = 0; i < d->n_buckets; i++)
+    {
+      if (d->buckets[i].n_entries > 1)
+        qsort (d->buckets[i].entries, d->buckets[i].n_entries,
+               sizeof *d->buckets[i].entries, irindexentry_compare);
+      n_widths += i * d->buckets[i].n_entries;
+    }
+
+  /* Lay the widths out in index order */
+  w = d->widths = malloc ((n_widths ? n_widths : 1) * sizeof *d->widths);
+  for (i = 0; i < d->n_buckets; i++)
+    for (j = 0; j < d->buckets[i].n_entries; j++)
+      {
+        IRIndexEntry *e = &d->buckets[i].entries[j];
+        memcpy (w, e->symbol->packet->widths, i * sizeof *w);
+        e->widths = w;
+        w += i;
+      }
+
+  /* An entry is shadowed if a later symbol's packet is close enough
+     that one received packet could match both. Only unshadowed
+     entries can answer a lookup by the grid alone. */
+  d->jitter = irtoy_jitter;
+  for (i = 0; i < d->n_buckets; i++)
+    {
+      IRIndexBucket *b = &d->buckets[i];
+      for (j = 0; j < b->n_entries; j++)
         {
-          c++;
-          if (k->pulses[i].value)
-            fputc ('|', out);
-          else
-            fputc ('_', out);
+          IRIndexEntry *e = &b->entries[j];
+          int m;
+          e->shadowed = false;
+          for (m = j - 1; m >= 0 && !e->shadowed
+               && b->entries[m].total >= e->total - 2 * d->jitter; m--)
+            e->shadowed = b->entries[m].symbol->serial > e->symbol->serial
+              && irwidths_match (e->widths, b->entries[m].widths, i,
+                                 2 * d->jitter);
+          for (m = j + 1; m < b->n_entries && !e->shadowed
+               && b->entries[m].total <= e->total + 2 * d->jitter; m++)
+            e->shadowed = b->entries[m].symbol->serial > e->symbol->serial
+              && irwidths_match (e->widths, b->entries[m].widths, i,
+                                 2 * d->jitter);
         }
     }
+
+  /* Snapped widths hash, at most half full */
+  d->grid = irtoy_grid;
+  d->n_grid_slots = 1;
+  while (d->n_grid_slots < 2 * d->n_symbols)
+    d->n_grid_slots *= 2;
+  if (d->grid > 0)
+    {
+      d->grid_slots = calloc (d->n_grid_slots, sizeof *d->grid_slots);
+      for (i = 0; i < d->n_buckets; i++)
+        for (j = 0; j < d->buckets[i].n_entries; j++)
+          {
+            IRIndexEntry *e = &d->buckets[i].entries[j];
+            IRIndexEntry **slot = irdict_grid_slot (d, e->widths, i);
+            if (!*slot || (*slot)->symbol->serial < e->symbol->serial)
+              *slot = e;
+          }
+    }
+
+  /* Code hash, likewise */
+  d->n_code_slots = d->n_grid_slots;
+  d->code_slots = calloc (d->n_code_slots, sizeof *d->code_slots);
+  for (s = d->first; s; s = s->next)
+    if (s->has_code)
+      {
+        IRSymbol **slot = irdict_code_slot (d, &s->code);
+        if (!*slot || (*slot)->serial < s->serial)
+          *slot = s;
+      }
+
+  /* Prefix trie for early matching */
+  {
+    IRSymbol **sorted = malloc ((d->n_symbols ? d->n_symbols : 1)
+                                * sizeof *sorted);
+    i = 0;
+    for (s = d->first; s; s = s->next)
+      sorted[i++] = s;
+    qsort (sorted, i, sizeof *sorted, irsymbol_widths_compare);
+    d->trie = malloc ((n_widths + 1) * sizeof *d->trie);
+    d->trie[0].width = 0;
+    d->trie[0].total = 0;
+    d->n_trie_nodes = 1;
+    irdict_build_trie (d, 0, sorted, i, 0);
+    free (sorted);
+  }
+
+  d->generation++;
+  d->index_valid = true;
 }
 
-IRPacket *
-irpacket_scanf (FILE * in)
+static void
+irdict_check_index (IRDict * d)
 {
-  /* Read it from IN */
-  IRPacket *k = new_irpacket ();
-  char buffer[BUFSIZ];
-  IRPulse pulse;
-  pulse.value = 0;
+  if (!d->index_valid || d->grid != irtoy_grid || d->jitter != irtoy_jitter)
+    irdict_build_index (d);
+}
 
-  if (!fscanf (in, "%s", buffer) || feof (in))
-    return NULL;
-  if (strcmp (buffer, "{"))
-    fatal (0, "Malformed packet: expected '{', got '%s'", buffer);
-  while (!feof (in))
+/* Find the name id for this packet, or -1. If several symbols match,
+ * the most recently inserted one wins.
+ */
+int
+irdict_lookup_packet (IRDict * d, IRPacket * k)
+{
+  IRIndexBucket *b;
+  IRSymbol *best = NULL;
+  IRCode code;
+  int total, lo, hi;
+
+  irdict_check_index (d);
+
+  /* A decoded packet is one probe, if any symbol has its code */
+  if (irpacket_decode (k, &code))
     {
-      fscanf (in, "%s", buffer);
-      if (strcmp (buffer, "}"))
+      IRSymbol *s = *irdict_code_slot (d, &code);
+      if (s)
         {
-          int width = atoi (buffer);
-          if (width < 0 || width > 0xffff)
-            fatal (0, "Malformed packet: expected short int or '}', got '%s'",
-                   buffer);
-          pulse.width = width;
-          pulse.value = !pulse.value;
-          irpacket_pulse (k, pulse);
+          d->code_hits++;
+          return s->id;
         }
-      else
+    }
+
+  /* So is one that snaps to the same grid as a stored packet. It
+     still has to match within the jitter, since widths either side of
+     a grid line don't, and no later symbol may match too. */
+  if (d->grid > 0 && k->n_pulses < d->n_buckets)
+    {
+      IRIndexEntry *e = *irdict_grid_slot (d, k->widths, k->n_pulses);
+      if (e && !e->shadowed
+          && irwidths_match (e->widths, k->widths, k->n_pulses,
+                             irtoy_jitter))
         {
-          irpacket_complete (k);
-          break;
+          d->grid_hits++;
+          return e->symbol->id;
         }
     }
-  return k;
-}
 
-/* Do two packets match? */
-bool
-irpacket_match (IRPacket * a, IRPacket * b, int jitter)
-{
-  int i;
-  int a_total = 0, b_total = 0;
-  if (a->n_pulses != b->n_pulses)
-    return false;
-  for (i = 0; i < a->n_pulses; i++)
+  d->slow_lookups++;
+  if (k->n_pulses >= d->n_buckets)
+    return -1;
+  b = &d->buckets[k->n_pulses];
+  if (!b->n_entries)
+    return -1;
+
+  /* Binary search for the first entry with a total that could match.
+     The total check in irpacket_match is absolute, so anything
+     outside [total - jitter, total + jitter] can't match. */
+  total = irpacket_total (k);
+  lo = 0;
+  hi = b->n_entries;
+  while (lo < hi)
     {
-      a_total += a->pulses[i].width;
-      b_total += b->pulses[i].width;
-      if (abs (a->pulses[i].width - b->pulses[i].width) <= jitter)
-        continue;
+      int mid = (lo + hi) / 2;
+      if (b->entries[mid].total < total - irtoy_jitter)
+        lo = mid + 1;
       else
-        return false;
+        hi = mid;
     }
-  /* The total packet time should also fit into the allowed jitter:
-   * it's not cumulative.
-   */
-  if (abs (a_total - b_total) <= jitter)
-    return true;
-  else
-    return false;
+  for (; lo < b->n_entries && b->entries[lo].total <= total + irtoy_jitter;
+       lo++)
+    {
+      IRIndexEntry *e = &b->entries[lo];
+      if (best && e->symbol->serial < best->serial)
+        continue;
+      if (irwidths_match (e->widths, k->widths, k->n_pulses, irtoy_jitter))
+        best = e->symbol;
+    }
+  if (best)
+    d->slow_hits++;
+  return best ? best->id : -1;
 }
 
-/* ------------------------------------------------------------
- * Dict/Symbol handling
- * XXX note: just about everything here is O(n). That shouldn't matter
- * though. 
- */
-
-IRDict *
-new_irdict (void)
+/* Insert a symbol in the dictionary */
+static IRSymbol *
+irdict_add (IRDict * d, const char *name, IRPacket * k)
 {
-  IRDict *d = malloc (sizeof *d);
-  d->first = NULL;
-  d->by_name = dict_new (NULL);
-  return d;
+  IRSymbol *s = malloc (sizeof *s);
+  s->next = d->first;
+  s->name = name;
+  s->id = irdict_intern (d, name);
+  s->packet = k;
+  s->serial = d->n_symbols++;
+  s->frames = NULL;
+  s->n_frames = 0;
+  s->has_code = false;
+  d->first = s;
+  d->index_valid = false;
+  if (!d->transmit[s->id])
+    d->transmit[s->id] = s;
+  return s;
 }
 
-/* Find a symbol (any symbol) for this name.
- */
-IRPacket *
-irdict_lookup_name (IRDict * d, const char *name)
+void
+irdict_insert (IRDict * d, const char *name, IRPacket * k)
 {
-  IRSymbol *s;
-  s = dict_get (d->by_name, name);
-  if (s)
-    return s->packet;
-  else
-    return NULL;
+  IRSymbol *s = irdict_add (d, name, k);
+  s->has_code = irpacket_decode (k, &s->code);
 }
 
-/* Find a symbol name for this packet */
-const char *
-irdict_lookup_packet (IRDict * d, IRPacket * k)
+/* Insert a symbol whose packet is already decoded: to CODE, or NULL
+   if it has none */
+void
+irdict_insert_decoded (IRDict * d, const char *name, IRPacket * k,
+                       const IRCode * code)
 {
-  IRSymbol *s;
-  for (s = d->first; s; s = s->next)
-    if (irpacket_match (s->packet, k, irtoy_jitter))
-      return s->name;
-  return NULL;
+  IRSymbol *s = irdict_add (d, name, k);
+  if (code)
+    {
+      s->has_code = true;
+      s->code = *code;
+    }
 }
 
-/* Insert a symbol in the dictionary */
+/* Insert a symbol by its code; its packet has nominal timings */
 void
-irdict_insert (IRDict * d, const char *name, IRPacket * k)
+irdict_insert_code (IRDict * d, const char *name, const IRCode * code)
 {
-  IRSymbol *s = malloc (sizeof *s);
-  s->next = d->first;
-  s->name = name;
-  s->packet = k;
-  d->first = s;
-  if (!dict_has_key (d->by_name, name))
-    dict_insert (d->by_name, name, s);
-  //XXX
-  irpacket_decode(k);
+  IRPacket *k = ircode_packet (code);
+  IRSymbol *s;
+  if (!k)
+    fatal (0, "Can't encode '%s' in protocol %d", name, code->protocol);
+  s = irdict_add (d, name, k);
+  s->has_code = true;
+  s->code = *code;
 }
 
 /* ------------------------------------------------------------
@@ -288,14 +1963,207 @@ new_irstate (void)
   ir->fd = -1;
   ir->buf_valid = false;
   ir->timed_out = false;
+  ir->gap = irtoy_gap;
+  ir->acks_expected = 0;
+  ir->acks_received = 0;
+  ir->ack_len = 0;
+  ir->pool_free = NULL;
+  ir->pool_pulses = 128;
+  ir->pool_size = 0;
+  ir->pool_in_use = 0;
+  ir->pool_high_water = 0;
+  ir->pool_spills = 0;
+  ir->early_dict = NULL;
+  ir->early_generation = 0;
+  ir->early_nodes = ir->early_next = NULL;
+  ir->n_early_nodes = 0;
+  ir->early_allocated = 0;
+  ir->early_total = 0;
+  ir->early_ready = false;
   return ir;
 }
 
+/* Set the number of pulses stored inline in pooled packets. Packets
+   already in use keep their old size and are freed on release. */
+void
+irstate_set_pool_pulses (IRState * ir, int n_pulses)
+{
+  if (n_pulses < 1)
+    n_pulses = 1;
+  while (ir->pool_free)
+    {
+      IRPacket *k = ir->pool_free;
+      ir->pool_free = k->next_free;
+      free (k);
+      ir->pool_size--;
+    }
+  ir->pool_pulses = n_pulses;
+}
+
+/* Set the gap, in multiples of the last pulse, that ends a packet */
+void
+irstate_set_gap (IRState * ir, int gap)
+{
+  ir->gap = gap;
+}
+
+static IRPacket *
+irstate_alloc_packet (IRState * ir)
+{
+  IRPacket *k = ir->pool_free;
+  if (k)
+    ir->pool_free = k->next_free;
+  else
+    {
+      k = malloc (sizeof *k + ir->pool_pulses * sizeof *k->inline_widths);
+      k->n_inline_pulses = ir->pool_pulses;
+      ir->pool_size++;
+    }
+  k->widths = k->inline_widths;
+  k->n_pulses_allocated = k->n_inline_pulses;
+  k->n_pulses = 0;
+  k->next_free = NULL;
+  k->early_id = -1;
+  k->early_taken = false;
+  if (++ir->pool_in_use > ir->pool_high_water)
+    ir->pool_high_water = ir->pool_in_use;
+  return k;
+}
+
+/* Hand a packet returned by irstate_pulse/irstate_timeout/
+   irstate_rxbytes back to the pool once it's been dealt with. */
+void
+irstate_release_packet (IRState * ir, IRPacket * k)
+{
+  if (!k->n_inline_pulses)
+    {
+      free_irpacket (k);
+      return;
+    }
+  ir->pool_in_use--;
+  if (k->widths != k->inline_widths)
+    free (k->widths);
+  if (k->n_inline_pulses != ir->pool_pulses)
+    {
+      /* Allocated before a pool size change */
+      free (k);
+      ir->pool_size--;
+      return;
+    }
+  k->next_free = ir->pool_free;
+  ir->pool_free = k;
+}
+
+/* Match packets against D's symbols while they arrive, or not if D
+   is NULL. See irstate_take_early. */
+void
+irstate_set_early_dict (IRState * ir, IRDict * d)
+{
+  ir->early_dict = d;
+  ir->n_early_nodes = 0;
+  ir->early_ready = false;
+}
+
+/* Start early matching a new packet at the root of the trie */
+static void
+irstate_early_start (IRState * ir)
+{
+  irdict_check_index (ir->early_dict);
+  if (!ir->early_allocated)
+    {
+      ir->early_allocated = 16;
+      ir->early_nodes = malloc (ir->early_allocated * sizeof *ir->early_nodes);
+      ir->early_next = malloc (ir->early_allocated * sizeof *ir->early_next);
+    }
+  ir->early_generation = ir->early_dict->generation;
+  ir->early_nodes[0] = 0;
+  ir->n_early_nodes = 1;
+  ir->early_total = 0;
+  ir->early_ready = false;
+}
+
+/* Step every live trie node over a pulse of WIDTH. The packet is
+   recognised once every node still live leads only to one name and
+   one of them ends a symbol that the packet would match if it ended
+   now. */
+static void
+irstate_early_pulse (IRState * ir, uint16_t width)
+{
+  IRDict *d = ir->early_dict;
+  int id = -1;
+  bool mixed = false, complete = false;
+  int i, n_next = 0, *swap;
+
+  if (!d->index_valid || d->generation != ir->early_generation)
+    {
+      /* Rebuilt under us, give up on this packet */
+      ir->n_early_nodes = 0;
+      return;
+    }
+  ir->early_total += width;
+  for (i = 0; i < ir->n_early_nodes; i++)
+    {
+      IRTrieNode *t = &d->trie[ir->early_nodes[i]];
+      int lo = t->first_child, hi = t->first_child + t->n_children;
+      int end = hi;
+      while (lo < hi)
+        {
+          int mid = (lo + hi) / 2;
+          if (d->trie[mid].width < width - irtoy_jitter)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      for (; lo < end && d->trie[lo].width <= width + irtoy_jitter; lo++)
+        {
+          IRTrieNode *c = &d->trie[lo];
+          if (n_next == ir->early_allocated)
+            {
+              ir->early_allocated *= 2;
+              ir->early_nodes = realloc (ir->early_nodes, ir->early_allocated
+                                         * sizeof *ir->early_nodes);
+              ir->early_next = realloc (ir->early_next, ir->early_allocated
+                                        * sizeof *ir->early_next);
+            }
+          ir->early_next[n_next++] = lo;
+          if (c->id < 0 || (id >= 0 && id != c->id))
+            mixed = true;
+          id = c->id;
+          if (c->terminal && abs (c->total - ir->early_total) <= irtoy_jitter)
+            complete = true;
+        }
+    }
+  swap = ir->early_nodes;
+  ir->early_nodes = ir->early_next;
+  ir->early_next = swap;
+  ir->n_early_nodes = n_next;
+  if (n_next && !mixed && complete)
+    {
+      ir->packet->early_id = id;
+      ir->early_ready = true;
+      ir->n_early_nodes = 0;
+    }
+}
+
+/* The name id the packet still arriving was recognised as, once
+   only, or -1. The completed packet comes back from irstate_pulse with
+   early_taken set, so the caller can skip dispatching it again. A
+   packet that completes before this is called is left to the caller
+   as usual. */
+int
+irstate_take_early (IRState * ir)
+{
+  if (!ir->early_ready)
+    return -1;
+  ir->early_ready = false;
+  ir->packet->early_taken = true;
+  return ir->packet->early_id;
+}
+
 IRPacket *
 irstate_pulse (IRState * ir, unsigned short width)
 {
   IRPacket *k;
-  IRPulse p;
   bool timed_out = ir->timed_out;
   ir->timed_out = false;
   /* Previous signal value was IR->VALUE. This pulse marks the end of
@@ -307,12 +2175,13 @@ irstate_pulse (IRState * ir, unsigned short width)
         irpacket_complete (ir->packet);
       k = ir->packet;
       ir->packet = NULL;
+      ir->early_ready = false;
       ir->value = false;        /* idle */
       return k;
     }
   /* Real pulse, flip current state */
   ir->value = !ir->value;
-  if (ir->value == false && width > irtoy_gap * ir->last_width)
+  if (ir->value == false && width > ir->gap * ir->last_width)
     {
       /* Gap between packets */
 
@@ -326,17 +2195,25 @@ irstate_pulse (IRState * ir, unsigned short width)
       irpacket_complete (ir->packet);
       k = ir->packet;
       ir->packet = NULL;
+      ir->early_ready = false;
       ir->value = false;
       return k;
     }
 
   /* Got an actual non-terminal pulse */
   if (!ir->packet)
-    ir->packet = new_irpacket ();
-  p.value = ir->value;
-  p.width = width;
-  irpacket_pulse (ir->packet, p);
+    {
+      ir->packet = irstate_alloc_packet (ir);
+      if (ir->early_dict)
+        irstate_early_start (ir);
+    }
+  else if (ir->packet->widths == ir->packet->inline_widths
+           && ir->packet->n_pulses == ir->packet->n_pulses_allocated)
+    ir->pool_spills++;
+  irpacket_pulse (ir->packet, width);
   ir->last_width = width;
+  if (ir->n_early_nodes)
+    irstate_early_pulse (ir, width);
   return NULL;
 }
 
@@ -348,6 +2225,7 @@ irstate_timeout (IRState * ir)
     irpacket_complete (ir->packet);
   k = ir->packet;
   ir->packet = NULL;
+  ir->early_ready = false;
   ir->timed_out = true;
   if (ir->buf_valid && ir->buf == 0xff)
     {
@@ -370,6 +2248,22 @@ irstate_rxbytes (IRState * ir, int n_bytes, unsigned char *bytes,
   int n_out_packets = 0;
   for (i = 0; i < n_bytes; i++)
     {
+      /* After a transmit, the IRToy answers with IR_ACK_LEN bytes. It
+         doesn't sample while transmitting, and irstate_expect_ack ends
+         any packet still open, so the response turns up between
+         packets rather than inside one. */
+      if (ir->ack_len
+          || (ir->acks_expected && !ir->buf_valid && !ir->packet))
+        {
+          ir->ack[ir->ack_len++] = bytes[i];
+          if (ir->ack_len == IR_ACK_LEN)
+            {
+              ir->ack_len = 0;
+              ir->acks_expected--;
+              ir->acks_received++;
+            }
+          continue;
+        }
       if (ir->buf_valid)
         {
           unsigned short width;
@@ -390,6 +2284,39 @@ irstate_rxbytes (IRState * ir, int n_bytes, unsigned char *bytes,
   return n_out_packets;
 }
 
+/* A frame has been sent; its response will arrive with the sample
+   data. A packet can still be open if its button was dispatched
+   early: the IRToy has stopped sampling it, so it ends here as on a
+   timeout and is returned. Half a width still buffered is dropped. */
+IRPacket *
+irstate_expect_ack (IRState * ir)
+{
+  IRPacket *k = NULL;
+  if (ir->packet)
+    k = irstate_timeout (ir);
+  ir->buf_valid = false;
+  ir->acks_expected++;
+  return k;
+}
+
+/* Give up waiting for the oldest outstanding response */
+void
+irstate_cancel_ack (IRState * ir)
+{
+  if (ir->acks_expected)
+    ir->acks_expected--;
+  ir->ack_len = 0;
+}
+
+/* Number of transmit responses received since the last call */
+int
+irstate_collect_acks (IRState * ir)
+{
+  int n = ir->acks_received;
+  ir->acks_received = 0;
+  return n;
+}
+
 void
 irstate_open (IRState * ir, const char *dev)
 {
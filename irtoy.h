@@ -4,55 +4,149 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-#include "dict.h"
+#include "lexer.h"
 
 typedef struct IRState IRState;
-typedef struct IRPulse IRPulse;
 typedef struct IRPacket IRPacket;
 typedef struct IRSymbol IRSymbol;
 typedef struct IRDict IRDict;
+typedef struct IRFrame IRFrame;
+typedef struct IRIndexEntry IRIndexEntry;
+typedef struct IRIndexBucket IRIndexBucket;
+typedef struct IRCapture IRCapture;
+typedef struct IRCluster IRCluster;
+typedef struct IRClusters IRClusters;
+typedef struct IRCode IRCode;
+typedef struct IRTrieNode IRTrieNode;
 
 /* ------------------------------------------------------------
  * IR Pulses and Packets
+ * A packet is a run of pulse widths. Marks (IR on) and spaces
+ * alternate, starting with a mark, so the value of a pulse is implied
+ * by its index.
  */
 
+#define IRPULSE_MARK(i) (((i) & 1) == 0)
+
 struct IRPacket
 {
-  IRPulse *pulses;
+  uint16_t *widths;
   int n_pulses;
   int n_pulses_allocated;
-};
 
-struct IRPulse
-{
-  bool value;
-  unsigned short width;
+  /* Packets from an IRState pool keep their widths inline, and only
+     spill to the heap when they outgrow them. */
+  int n_inline_pulses;          /* 0 if not from a pool */
+  IRPacket *next_free;
+
+  /* Name id the early matcher recognised the packet as before it
+     ended, or -1, and whether irstate_take_early handed that out */
+  int early_id;
+  bool early_taken;
+  uint16_t inline_widths[];
 };
 
 extern IRPacket *new_irpacket (void);
 extern void free_irpacket (IRPacket * k);
 extern bool irpacket_complete (IRPacket * k);
-extern void irpacket_pulse (IRPacket * k, IRPulse pulse);
+extern void irpacket_pulse (IRPacket * k, uint16_t width);
 extern void irpacket_printf (FILE * out, IRPacket * k);
 extern void irpacket_render (FILE * out, IRPacket * k);
 extern IRPacket *irpacket_scanf (FILE * in);
+extern IRPacket *irpacket_lex (Lexer * lx);
+extern IRPacket *irpacket_lex_widths (Lexer * lx);
 extern bool irpacket_match (IRPacket * a, IRPacket * b, int jitter);
+extern int irpacket_min_jitter (IRPacket * a, IRPacket * b);
+
+extern bool irpacket_decode (const IRPacket * k, IRCode * code);
+extern IRPacket *ircode_packet (const IRCode * code);
+extern const char *irprotocol_name (int protocol);
+extern int irprotocol_lookup (const char *name);
+
+extern IRClusters *irclusters_from_histogram (const int *counts,
+                                              int max_width);
+extern void free_irclusters (IRClusters * c);
+extern int irclusters_classify (const IRClusters * c, int width);
+extern int irclusters_jitter (const IRClusters * c);
+extern void irpacket_quantize (const IRPacket * k, const IRClusters * c,
+                               uint8_t * out);
+
+extern IRCapture *ircapture_open (const char *file);
+extern IRPacket *ircapture_next (IRCapture * c);
+extern void ircapture_close (IRCapture * c);
+extern void ircapture_write_header (FILE * out);
+extern void ircapture_write_tag (FILE * out, int tag, const char *name);
+extern void ircapture_write_packet (FILE * out, IRPacket * k, int tag,
+                                    uint64_t timestamp);
 
 extern IRDict *new_irdict (void);
+extern void free_irdict (IRDict * d, bool owns_data);
+extern int irdict_intern (IRDict * d, const char *name);
+extern int irdict_name_id (IRDict * d, const char *name);
+extern const char *irdict_name (IRDict * d, int id);
 extern IRPacket *irdict_lookup_name (IRDict * d, const char *name);
-extern const char *irdict_lookup_packet (IRDict * d, IRPacket * k);
+extern IRSymbol *irdict_lookup_symbol (IRDict * d, const char *name);
+extern IRSymbol *irdict_id_symbol (IRDict * d, int id);
+extern const IRFrame *irsymbol_frame (IRSymbol * s, int repeats);
+extern int irdict_lookup_packet (IRDict * d, IRPacket * k);
 extern void irdict_insert (IRDict * d, const char *name, IRPacket * k);
+extern void irdict_insert_code (IRDict * d, const char *name,
+                                const IRCode * code);
+extern void irdict_insert_decoded (IRDict * d, const char *name,
+                                   IRPacket * k, const IRCode * code);
 extern IRState *new_irstate (void);
 extern IRPacket *irstate_pulse (IRState * ir, unsigned short width);
 extern IRPacket *irstate_timeout (IRState * ir);
 extern int irstate_rxbytes (IRState * ir, int n_bytes, unsigned char *bytes,
                             IRPacket ** out_packets);
 extern void irstate_open (IRState * ir, const char *dev);
+extern void irstate_set_pool_pulses (IRState * ir, int n_pulses);
+extern void irstate_set_gap (IRState * ir, int gap);
+extern void irstate_release_packet (IRState * ir, IRPacket * k);
+extern IRPacket *irstate_expect_ack (IRState * ir);
+extern void irstate_cancel_ack (IRState * ir);
+extern int irstate_collect_acks (IRState * ir);
+extern void irstate_set_early_dict (IRState * ir, IRDict * d);
+extern int irstate_take_early (IRState * ir);
+
+/* ------------------------------------------------------------
+ * Decoded packets
+ * A packet in a known protocol, with any toggle bit dropped. Address
+ * and command are as the protocol defines them; for Kaseikyo the
+ * address is the 16 bit vendor and the command is the other 32 bits.
+ */
+
+enum
+{
+  irproto_raw,                  /* no known protocol */
+  irproto_nec,
+  irproto_samsung,              /* NEC with a 4.5ms header mark */
+  irproto_jvc,
+  irproto_kaseikyo,
+  irproto_sirc12,
+  irproto_sirc15,
+  irproto_sirc20,
+  irproto_rc5,
+  irproto_rc6,                  /* mode 0 */
+  irproto_count
+};
+
+struct IRCode
+{
+  int protocol;
+  uint32_t address;
+  uint32_t command;
+};
+
+/* Bytes in the IRToy's response to a transmitted frame */
+#define IR_ACK_LEN 3
 
 
 extern int irtoy_gap;           /* min gap between packets */
 extern int irtoy_jitter;        /* acceptable jitter */
+extern int irtoy_grid;          /* exact match grid, 0 for none */
 
 struct IRState
 {
@@ -63,20 +157,182 @@ struct IRState
   unsigned char buf;
   bool buf_valid;
   bool timed_out;
+  int gap;                      /* irtoy_gap, unless set */
+
+  /* Transmit responses */
+  int acks_expected;            /* frames sent, response not yet seen */
+  int acks_received;            /* responses not yet collected */
+  unsigned char ack[IR_ACK_LEN]; /* last (or partial) response */
+  int ack_len;
+
+  /* Pool of received packets, handed back by irstate_release_packet */
+  IRPacket *pool_free;
+  int pool_pulses;              /* pulses stored inline per packet */
+  int pool_size;                /* packets allocated */
+  int pool_in_use;
+  int pool_high_water;          /* most packets in use at once */
+  int pool_spills;              /* packets that outgrew pool_pulses */
+
+  /* Early matching: the trie nodes of early_dict that the packet so
+     far matches within the jitter */
+  IRDict *early_dict;
+  int early_generation;         /* of early_dict's index */
+  int *early_nodes, *early_next;
+  int n_early_nodes;
+  int early_allocated;
+  int early_total;              /* sum of widths so far */
+  bool early_ready;             /* recognised, not yet taken */
+};
+
+/* An encoded IRToy transmit frame: the transmit command, big-endian
+ * pulse widths, and the 0xff 0xff terminator.
+ */
+struct IRFrame
+{
+  int len;
+  unsigned char *data;
 };
 
 struct IRSymbol
 {
   const char *name;
+  int id;                       /* of NAME, see irdict_intern */
   IRPacket *packet;
   IRSymbol *next;
+  int serial;                   /* insertion order; later shadows earlier */
+  bool has_code;                /* PACKET decodes to CODE */
+  IRCode code;
+
+  /* Transmit frames, built on first use. frames[r - 1] sends the
+     packet R times. */
+  IRFrame **frames;
+  int n_frames;
+};
+
+/* Matcher index: symbols are bucketed by pulse count, and each bucket
+ * is sorted by total packet duration so that a lookup only has to
+ * compare against entries within irtoy_jitter of the received packet.
+ */
+struct IRIndexEntry
+{
+  int total;                    /* sum of pulse widths */
+  const uint16_t *widths;       /* in IRDict widths */
+  IRSymbol *symbol;
+  bool shadowed;                /* a later symbol is within 2 * jitter */
+};
+
+/* Prefix trie of every symbol's widths, for matching a packet while
+ * it arrives. Node 0 is the root.
+ */
+struct IRTrieNode
+{
+  uint16_t width;               /* of the pulse leading here */
+  int total;                    /* sum of widths to here */
+  int first_child;              /* children are contiguous, by width */
+  int n_children;
+  IRSymbol *terminal;           /* latest symbol ending here */
+  int id;                       /* name id of every symbol below, or -1 */
+};
+
+struct IRIndexBucket
+{
+  int n_entries;
+  IRIndexEntry *entries;
 };
 
 struct IRDict
 {
   IRSymbol *first;
-  Dict *by_name;
+  int n_symbols;
+
+  /* Every name interned, whether or not a symbol has it: keymaps ask
+     for ids too. Ids are small and dense. */
+  int *id_slots;                /* open hash of names: id + 1, or 0 */
+  int n_id_slots;               /* power of two */
+  const char **names;           /* by id */
+  IRSymbol **transmit;          /* by id, the symbol sent for a name */
+  int n_names;
+  int n_names_allocated;
+
+  /* Index, rebuilt lazily after an insert. The widths of every symbol
+     are copied into one array in index order, so scanning a bucket is
+     a straight walk through memory. */
+  bool index_valid;
+  int n_buckets;                /* buckets[n_pulses] for n_pulses < n_buckets */
+  IRIndexBucket *buckets;
+  uint16_t *widths;
+  int generation;               /* bumped on every rebuild */
+
+  int n_trie_nodes;
+  IRTrieNode *trie;
+
+  /* Open hash of symbols with a code, latest serial per code */
+  int n_code_slots;             /* power of two */
+  IRSymbol **code_slots;
+
+  /* Open hash of entries by widths snapped to a grid, latest serial
+     per snapped packet */
+  int grid;                     /* irtoy_grid when built */
+  int jitter;                   /* irtoy_jitter when built */
+  int n_grid_slots;             /* power of two */
+  IRIndexEntry **grid_slots;
+
+  /* Lookup counters */
+  long code_hits;               /* found by decoded code */
+  long grid_hits;               /* found by snapped widths */
+  long slow_lookups;            /* fell back to the jitter search */
+  long slow_hits;               /* ... and found a match */
+};
+
+/* ------------------------------------------------------------
+ * Pulse width clusters
+ * The unit widths of the protocols in a set of packets, found from a
+ * histogram of their widths. Clusters are in ascending order of width.
+ */
+
+struct IRCluster
+{
+  int lo, hi;                   /* widths seen */
+  int centre;                   /* mean width */
+  int spread;                   /* half-width holding 99% of pulses */
+  int count;
+};
+
+struct IRClusters
+{
+  int n_clusters;
+  IRCluster *clusters;
 };
 
+/* ------------------------------------------------------------
+ * Capture files
+ * A run of received packets, each optionally tagged with the key or
+ * source it came from and when it was received. Captures are either
+ * text, as read by irpacket_scanf or written to out_file, or the
+ * binary form described in irtoy.c, which is mapped and read in place.
+ */
+
+#define IRCAP_NO_TAG 0xffff
+
+struct IRCapture
+{
+  const char *fname;
+  unsigned char *map;
+  size_t size;
+  size_t pos;
+  bool binary;                  /* widths point into map */
+  Lexer *lexer;                 /* for text */
+
+  int n_tags;
+  char **tags;
+
+  /* Current packet */
+  IRPacket *packet;
+  int tag;                      /* IRCAP_NO_TAG if none */
+  uint64_t timestamp;           /* usecs since the epoch, 0 if unknown */
+
+  uint16_t *text_widths;
+  int text_allocated;
+};
 
 #endif  /* __irtoy_h */
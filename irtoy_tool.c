@@ -6,20 +6,17 @@
  */
 #if __linux__
 #define USE_UINPUT
+#define USE_INOTIFY
 #endif
 /*
- * TODO: More efficient matching?
  * TODO: sort packets to find the best packet to transmit?
  * TODO: Move gap/jitter to IRState.
- * TODO: Don't reconstruct the fd_set every select().
  * TODO: better recording of samples? Because as it stands... this is gross.
  *
  * Oct 2016 to-do
  * - command to set 'UNKNOWN' key name in output
  * - refactor analysis to take one file, and clean it out.
  * - globs in device names
- * - decode packets to binary?
- * - use osascript in interactive mode with a pipe to cut out start overheads.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,6 +29,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -39,60 +37,459 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #ifdef USE_UINPUT
 #include <linux/uinput.h>
 #endif
+#ifdef USE_INOTIFY
+#include <sys/inotify.h>
+#endif
 
-#include "dict.h"
 #include "irtoy.h"
 #include "error.h"
 #include "keywords.h"
 #include "mac_actions.h"
 #include "server.h"
+#include "helper.h"
 
 int ir_packet_timeout = 100000;
 int ir_debounce_time = 250000;  /* initial repeat delay */
 int ir_repeat_delay = 0;        /* current repeat delay */
+int ir_write_limit = 65536;     /* max bytes queued for a network peer */
+ConnectionOverflow ir_write_overflow = overflow_disconnect;
+int ir_transmit_timeout = 1000000; /* usecs to wait for a transmit response */
 
 /* ------------------------------------------------------------
  * Testing stuff
  */
 
+/* The packets of one key: those from one untagged file, or with one
+   tag in any capture */
 typedef struct PacketFile PacketFile;
 struct PacketFile
 {
   char *fname;
   int n_packets;
+  int n_packets_allocated;
   IRPacket **packets;
 };
 
-PacketFile *
-read_packets (FILE * in)
+/* Packets read for analysis live as long as the process, so they're
+   carved out of big blocks rather than allocated one by one */
+static void *
+packet_store (size_t size)
+{
+  static char *block;
+  static size_t left;
+  void *p;
+  size = (size + 7) & ~(size_t) 7;
+  if (size > left)
+    {
+      left = size > 1 << 20 ? size : 1 << 20;
+      block = malloc (left);
+      if (!block)
+        fatal (0, "Out of memory reading packets");
+    }
+  p = block;
+  block += size;
+  left -= size;
+  return p;
+}
+
+/* The entry for key NAME, added if new */
+static PacketFile *
+packet_file (PacketFile ***files, int *n_files, const char *name)
+{
+  char *fname = strdup (name), *c;
+  int i;
+  for (c = fname; *c; c++)
+    if (*c == '/')
+      *c = '_';
+  for (i = *n_files - 1; i >= 0; i--)
+    if (!strcmp ((*files)[i]->fname, fname))
+      {
+        free (fname);
+        return (*files)[i];
+      }
+  *files = realloc (*files, (*n_files + 1) * sizeof **files);
+  (*files)[*n_files] = calloc (1, sizeof ***files);
+  (*files)[*n_files]->fname = fname;
+  return (*files)[(*n_files)++];
+}
+
+/* Read the capture FILE, adding its packets to FILES by tag, or under
+   the file's own name if untagged. Returns the number of files. */
+int
+read_packets (const char *file, PacketFile ***files, int n_files)
 {
-  PacketFile *pf;
-  int n_packets_allocated = 1;
+  IRCapture *c = ircapture_open (file);
+  IRPacket *k;
+  int i, first_new = n_files;
+
+  while ((k = ircapture_next (c)))
+    {
+      PacketFile *pf;
+      IRPacket *p;
+
+      pf = packet_file (files, &n_files, c->tag == IRCAP_NO_TAG
+                        ? file : c->tags[c->tag]);
+      p = packet_store (sizeof *p);
+      memset (p, 0, sizeof *p);
+      p->n_pulses = k->n_pulses;
+      if (c->binary)
+        p->widths = k->widths;  /* mapped until exit */
+      else
+        {
+          p->widths = packet_store (k->n_pulses * sizeof *p->widths);
+          memcpy (p->widths, k->widths, k->n_pulses * sizeof *p->widths);
+        }
+      /* Room for this packet and the terminating NULL */
+      if (pf->n_packets + 2 > pf->n_packets_allocated)
+        {
+          pf->n_packets_allocated = 2 * pf->n_packets_allocated + 2;
+          pf->packets = realloc (pf->packets, pf->n_packets_allocated
+                                 * sizeof *pf->packets);
+        }
+      pf->packets[pf->n_packets++] = p;
+      pf->packets[pf->n_packets] = NULL;
+    }
+  if (n_files == first_new && !c->n_tags)
+    packet_file (files, &n_files, file);     /* still list an empty file */
+  if (!c->binary)
+    ircapture_close (c);
+
+  for (i = first_new; i < n_files; i++)
+    printf ("Read %d packets from '%s'\n", (*files)[i]->n_packets,
+            (*files)[i]->fname);
+  return n_files;
+}
 
-  pf = malloc (sizeof *pf);
-  pf->packets = malloc (sizeof *pf->packets);
-  pf->n_packets = 0;
+/* Convert captures to binary (if OUT is non-NULL), or to text on
+   stdout. Untagged packets are tagged with their file's name in a
+   binary capture. */
+int
+convert_captures (const char *out_name, int n, char **name)
+{
+  FILE *out = stdout;
+  char **tags = NULL;
+  int n_tags = 0;
+  int i;
 
-  while (!feof (in))
+  if (out_name)
+    {
+      if (strcmp (out_name, "-") && !(out = fopen (out_name, "wb")))
+        fatal (0, "Can't create capture file '%s'", out_name);
+      ircapture_write_header (out);
+    }
+  for (i = 0; i < n; i++)
     {
+      IRCapture *c = ircapture_open (name[i]);
       IRPacket *k;
-      k = irpacket_scanf (in);
-      if (!k)
-        break;
-      if (pf->n_packets + 1 >= n_packets_allocated)
+      while ((k = ircapture_next (c)))
+        {
+          const char *tag = c->tag == IRCAP_NO_TAG ? NULL : c->tags[c->tag];
+          int t;
+          if (!out_name)
+            {
+              if (tag)
+                fprintf (out, "key \"%s\" ", tag);
+              if (c->timestamp)
+                fprintf (out, "@%llu ", (unsigned long long) c->timestamp);
+              irpacket_printf (out, k);
+              fprintf (out, "\n");
+              continue;
+            }
+          if (!tag)
+            tag = name[i];
+          for (t = 0; t < n_tags; t++)
+            if (!strcmp (tags[t], tag))
+              break;
+          if (t == n_tags)
+            {
+              if (n_tags == IRCAP_NO_TAG)
+                fatal (0, "Too many tags for capture file '%s'", out_name);
+              tags = realloc (tags, (n_tags + 1) * sizeof *tags);
+              tags[n_tags++] = strdup (tag);
+              ircapture_write_tag (out, t, tag);
+            }
+          ircapture_write_packet (out, k, t, c->timestamp);
+        }
+      ircapture_close (c);
+    }
+  if (fflush (out) || ferror (out))
+    fatal (0, "Error writing converted packets");
+  if (out != stdout)
+    fclose (out);
+  for (i = 0; i < n_tags; i++)
+    free (tags[i]);
+  free (tags);
+  return 0;
+}
+
+/* ------------------------------------------------------------
+ * Packet analysis
+ * The O(n^2) parts are split across analysis_threads threads, each
+ * taking every analysis_threads'th row. Every thread writes its own
+ * cells or tallies, and results are combined in a fixed order, so the
+ * output doesn't depend on the number of threads.
+ *
+ * Packets with different pulse counts never match, so the jitter
+ * matrix only holds pairs within a group of equal n_pulses, and only
+ * one triangle of each group since it's symmetric.
+ */
+
+int analysis_threads = 1;
+
+typedef struct Analysis Analysis;
+struct Analysis
+{
+  int n_packets;
+  IRPacket **packets;
+  const char **names;
+  int *name_packets;            /* [packet]: packets sharing its name */
+  int jitter_max;
+
+  /* Jitter matrix, by n_pulses group */
+  int n_groups;
+  int *group;                   /* [packet]: its group */
+  int *group_pos;               /* [packet]: its index in the group */
+  int *group_size;              /* [group] */
+  int **group_members;          /* [group][index]: packet, ascending */
+  uint8_t **tri;                /* [group]: upper triangle, row-major */
+
+  /* Per-thread results */
+  int *max_useful_jitter;       /* [thread] */
+  long *same_at;                /* [thread][jitter]: same-key pairs */
+  long *diff_at;                /* [thread][jitter]: different-key pairs */
+
+  /* Scoring */
+  const char *fname;            /* file being scored */
+  bool *keep;
+  int *scores;
+  int best_jitter;
+};
+
+typedef struct AnalysisThread AnalysisThread;
+struct AnalysisThread
+{
+  Analysis *a;
+  int thread;
+  void (*fn) (Analysis *a, int thread);
+  pthread_t tid;
+};
+
+static void *
+analysis_thread_main (void *p)
+{
+  AnalysisThread *t = p;
+  t->fn (t->a, t->thread);
+  return NULL;
+}
+
+/* Run FN (A, thread) on every analysis thread and wait for them all */
+void
+analysis_run (Analysis *a, void (*fn) (Analysis *a, int thread))
+{
+  AnalysisThread *threads;
+  int t;
+  if (analysis_threads <= 1)
+    {
+      fn (a, 0);
+      return;
+    }
+  threads = calloc (analysis_threads, sizeof *threads);
+  for (t = 1; t < analysis_threads; t++)
+    {
+      threads[t].a = a;
+      threads[t].thread = t;
+      threads[t].fn = fn;
+      if (pthread_create (&threads[t].tid, NULL, analysis_thread_main,
+                          &threads[t]))
+        fatal (0, "Couldn't create analysis thread");
+    }
+  fn (a, 0);
+  for (t = 1; t < analysis_threads; t++)
+    pthread_join (threads[t].tid, NULL);
+  free (threads);
+}
+
+/* Offset of (I, J), I <= J, in the triangle of a group of size K */
+#define TRI_INDEX(k, i, j) \
+  ((size_t) (i) * (k) - (size_t) (i) * ((i) - 1) / 2 + ((j) - (i)))
+
+/* Minimum jitter for packets X and Y to match */
+static int
+analysis_jitter (const Analysis *a, int x, int y)
+{
+  int g = a->group[x], i, j;
+  if (a->group[y] != g)
+    return a->jitter_max;
+  i = a->group_pos[x];
+  j = a->group_pos[y];
+  if (i > j)
+    {
+      int t = i;
+      i = j;
+      j = t;
+    }
+  return a->tri[g][TRI_INDEX (a->group_size[g], i, j)];
+}
+
+/* Group packets by n_pulses and allocate each group's triangle */
+static void
+analysis_group (Analysis *a)
+{
+  int x, g, max_pulses = 0;
+  int *by_pulses;
+  for (x = 0; x < a->n_packets; x++)
+    if (a->packets[x]->n_pulses > max_pulses)
+      max_pulses = a->packets[x]->n_pulses;
+  by_pulses = malloc ((max_pulses + 1) * sizeof *by_pulses);
+  for (x = 0; x <= max_pulses; x++)
+    by_pulses[x] = -1;
+  a->n_groups = 0;
+  a->group = calloc (a->n_packets + 1, sizeof *a->group);
+  a->group_pos = calloc (a->n_packets + 1, sizeof *a->group_pos);
+  a->group_size = calloc (a->n_packets + 1, sizeof *a->group_size);
+  for (x = 0; x < a->n_packets; x++)
+    {
+      int *gp = &by_pulses[a->packets[x]->n_pulses];
+      if (*gp < 0)
+        *gp = a->n_groups++;
+      a->group[x] = *gp;
+      a->group_pos[x] = a->group_size[*gp]++;
+    }
+  free (by_pulses);
+
+  a->group_members = calloc (a->n_groups + 1, sizeof *a->group_members);
+  a->tri = calloc (a->n_groups + 1, sizeof *a->tri);
+  for (g = 0; g < a->n_groups; g++)
+    {
+      size_t k = a->group_size[g];
+      a->group_members[g] = malloc (k * sizeof *a->group_members[g]);
+      a->tri[g] = malloc (k * (k + 1) / 2);
+      if (!a->group_members[g] || !a->tri[g])
+        fatal (0, "Can't allocate jitter matrix");
+    }
+  for (x = 0; x < a->n_packets; x++)
+    a->group_members[a->group[x]][a->group_pos[x]] = x;
+}
+
+static void
+analysis_free (Analysis *a)
+{
+  int g;
+  for (g = 0; g < a->n_groups; g++)
+    {
+      free (a->group_members[g]);
+      free (a->tri[g]);
+    }
+  free (a->group_members);
+  free (a->tri);
+  free (a->group);
+  free (a->group_pos);
+  free (a->group_size);
+}
+
+/* Jitter matrix rows */
+static void
+analysis_matrix (Analysis *a, int thread)
+{
+  int g, i, j;
+  int max_useful_jitter = 0;
+  for (g = 0; g < a->n_groups; g++)
+    {
+      int k = a->group_size[g];
+      int *members = a->group_members[g];
+      for (i = thread; i < k; i += analysis_threads)
+        for (j = i; j < k; j++)
+          {
+            int d = irpacket_min_jitter (a->packets[members[i]],
+                                         a->packets[members[j]]);
+            if (d < 0 || d > a->jitter_max)
+              d = a->jitter_max;        /* never match */
+            a->tri[g][TRI_INDEX (k, i, j)] = d;
+            if (d > max_useful_jitter && d != a->jitter_max)
+              max_useful_jitter = d;
+          }
+    }
+  a->max_useful_jitter[thread] = max_useful_jitter;
+}
+
+/* Tally pairs within each group by the jitter they need to match.
+   Pairs across groups are added at jitter_max afterwards. */
+static void
+analysis_tally (Analysis *a, int thread)
+{
+  int g, i, j;
+  long *same_at = &a->same_at[thread * (a->jitter_max + 1)];
+  long *diff_at = &a->diff_at[thread * (a->jitter_max + 1)];
+  for (g = 0; g < a->n_groups; g++)
+    {
+      int k = a->group_size[g];
+      int *members = a->group_members[g];
+      for (i = thread; i < k; i += analysis_threads)
+        for (j = i; j < k; j++)
+          {
+            int d = a->tri[g][TRI_INDEX (k, i, j)];
+            if (a->names[members[i]] == a->names[members[j]])
+              same_at[d]++;
+            else
+              diff_at[d]++;
+          }
+    }
+}
+
+/* Score the kept packets of one file */
+static void
+analysis_score (Analysis *a, int thread)
+{
+  int x, i, n_packets = a->n_packets;
+  for (x = thread; x < n_packets; x += analysis_threads)
+    {
+      int g = a->group[x], k = a->group_size[g];
+      int x_score, same_in_group = 0;
+      if (!a->keep[x])
+        continue;
+      if (a->names[x] != a->fname)
+        continue;
+      for (i = 0; i < k; i++)
+        if (a->names[a->group_members[g][i]] == a->names[x])
+          same_in_group++;
+      /* Packets outside the group never match: those with another
+         name score, those with the same name are ignored below */
+      x_score = (n_packets - k) - (a->name_packets[x] - same_in_group);
+      for (i = 0; i < k; i++)
         {
-          n_packets_allocated *= 2;
-          pf->packets = realloc (pf->packets,
-                                 n_packets_allocated * sizeof *pf->packets);
+          int y = a->group_members[g][i];
+          bool match, same;
+          if (x == y)
+            continue;
+          match = analysis_jitter (a, x, y) <= a->best_jitter;
+          same = a->names[x] == a->names[y];
+          if (match && same && a->keep[y])
+            /* In this round, only score it if it helps us
+               narrow the field */
+            x_score++;
+          else if (match && !same)
+            x_score -= 1;       /* penalise false + */
+          else if (!match && same)
+            ;           /* Probably two distinct patterns
+                           from one key. Don't penalise. */
+          else if (!match && !same)
+            x_score++;
         }
-      pf->packets[pf->n_packets++] = k;
+      a->scores[x] = x_score;
     }
-  pf->packets[pf->n_packets] = NULL;
-  return pf;
+}
+
+static int
+compare_ints (const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
 }
 
 void
@@ -101,38 +498,33 @@ analyse_packet_files (int n, char **name)
   int i, x, y, j;
   const int jitter_max = 100;
   int max_useful_jitter = 0;
-  FILE *in;
-  PacketFile **files = malloc (n * sizeof *files);
+  PacketFile **files = NULL;
+  int n_files = 0;
   int n_packets = 0;
   IRPacket **packets;
   const char **names;
-  int *m;
+  int *name_packets;
+  IRClusters *clusters;
   int best_jitter;
-  int best_jitter_score;
+  long best_jitter_score;
   bool *keep;
   bool changed;
   int *scores;
   int *kept_packets;
+  Analysis a;
+  long same_pairs = 0, same_within = 0, diff_within = 0;
+  long total_same = 0, total_pairs;
 
   for (i = 0; i < n; i++)
-    {
-      char *c;
-      in = fopen (name[i], "r");
-      if (!in)
-        fatal (0, "Can't open input file '%s'", name[i]);
-      files[i] = read_packets (in);
-      files[i]->fname = strdup(name[i]);
-      for (c = files[i]->fname; *c; c++)
-        if (*c == '/')
-          *c = '_';
-      printf ("Read %d packets from '%s'\n", files[i]->n_packets,
-              files[i]->fname);
-      n_packets += files[i]->n_packets;
-    }
+    n_files = read_packets (name[i], &files, n_files);
+  n = n_files;
+  for (i = 0; i < n; i++)
+    n_packets += files[i]->n_packets;
 
   /* Build the big list */
   packets = calloc (n_packets + 1, sizeof *packets);
   names = calloc (n_packets + 1, sizeof *names);
+  name_packets = calloc (n_packets + 1, sizeof *name_packets);
   n_packets = 0;
   for (i = 0; i < n; i++)
     {
@@ -141,9 +533,12 @@ analyse_packet_files (int n, char **name)
         {
           packets[n_packets] = files[i]->packets[j];
           names[n_packets] = files[i]->fname;
+          name_packets[n_packets] = files[i]->n_packets;
           n_packets++;
         }
+      total_same += (long) files[i]->n_packets * (files[i]->n_packets + 1) / 2;
     }
+  total_pairs = (long) n_packets * (n_packets + 1) / 2;
 
   printf ("All packets\n");
   for (i = 0; i < n_packets; i++)
@@ -154,7 +549,6 @@ analyse_packet_files (int n, char **name)
     }
 
   printf ("%d packets\n", n_packets);
-  m = calloc (n_packets * n_packets, sizeof *m);
 
   printf ("Pulse width distribution\n");
   {
@@ -163,14 +557,14 @@ analyse_packet_files (int n, char **name)
     int *counts;
     for (i = 0; i < n_packets; i++)
       for (j = 0; j < packets[i]->n_pulses; j++)
-        if (max_pulse_width < packets[i]->pulses[j].width)
-          max_pulse_width = packets[i]->pulses[j].width;
+        if (max_pulse_width < packets[i]->widths[j])
+          max_pulse_width = packets[i]->widths[j];
     printf ("Max pulse width is %d\n", max_pulse_width);
     counts = calloc (max_pulse_width + 1, sizeof *counts);
     for (i = 0; i < n_packets; i++)
       for (j = 0; j < packets[i]->n_pulses; j++)
         {
-          int c = ++counts[packets[i]->pulses[j].width];
+          int c = ++counts[packets[i]->widths[j]];
           if (c > max_count)
             max_count = c;
         }
@@ -181,65 +575,155 @@ analyse_packet_files (int n, char **name)
           printf ("*");
         printf ("\n");
       }
+    clusters = irclusters_from_histogram (counts, max_pulse_width);
     free (counts);
   }
 
+  printf ("Pulse width clusters\n");
+  {
+    int gap = 1, max_pulses = 0, split = 0;
+    int *ratios, n_ratios = 0;
+    uint8_t *q;
+    for (i = 0; i < clusters->n_clusters; i++)
+      {
+        IRCluster *cl = &clusters->clusters[i];
+        printf ("%3d: centre %5d spread %3d widths %5d-%-5d count %d\n",
+                i, cl->centre, cl->spread, cl->lo, cl->hi, cl->count);
+      }
+
+    /* The gap should not end a packet at one of its own spaces, even
+       when the space and the mark before it are off by the jitter.
+       Runt marks would push it up a long way, so it only has to
+       cover 99% of spaces. */
+    j = irclusters_jitter (clusters);
+    for (i = 0; i < n_packets; i++)
+      {
+        if (packets[i]->n_pulses > max_pulses)
+          max_pulses = packets[i]->n_pulses;
+        n_ratios += packets[i]->n_pulses / 2;
+      }
+    ratios = malloc ((n_ratios + 1) * sizeof *ratios);
+    n_ratios = 0;
+    for (i = 0; i < n_packets; i++)
+      {
+        IRPacket *k = packets[i];
+        int p;
+        for (p = 1; p < k->n_pulses; p += 2)
+          {
+            int mark = k->widths[p - 1] > j ? k->widths[p - 1] - j : 1;
+            ratios[n_ratios++] = (k->widths[p] + j + mark - 1) / mark;
+          }
+      }
+    qsort (ratios, n_ratios, sizeof *ratios, compare_ints);
+    if (n_ratios)
+      gap = ratios[(n_ratios * 99L + 99) / 100 - 1];
+    free (ratios);
+    for (i = 0; i < n_packets; i++)
+      {
+        IRPacket *k = packets[i];
+        int p;
+        for (p = 1; p < k->n_pulses; p += 2)
+          if (k->widths[p] > gap * k->widths[p - 1])
+            {
+              split++;
+              break;
+            }
+      }
+    printf ("Proposed jitter %d, gap %d (splits %d of %d packets)\n",
+            j, gap, split, n_packets);
+
+    printf ("Quantized packets\n");
+    q = malloc (max_pulses + 1);
+    for (i = 0; i < n_packets; i++)
+      {
+        int p;
+        irpacket_quantize (packets[i], clusters, q);
+        printf ("%s [ ", names[i]);
+        for (p = 0; p < packets[i]->n_pulses; p++)
+          printf ("%d ", q[p]);
+        printf ("] {");
+        for (p = 0; p < packets[i]->n_pulses; p++)
+          if (q[p] < clusters->n_clusters)
+            printf (" %d", clusters->clusters[q[p]].centre);
+          else
+            printf (" ?");      /* unclassified, or past index 254 */
+        printf (" }\n");
+      }
+    free (q);
+  }
+
   /* Jitter Matrix.
      This holds, for each combination of X and Y, minimum jitter
      necessary to allow them to match, so is a measure of the
      proximity of the packets in the structural space.
   */
   printf ("Computing jitter matrix\n");
-  for (y = 0; y < n_packets; y++)
-    for (x = y; x < n_packets; x++)
-      {
-        int i;
-        for (i = 0; i < jitter_max; i++)
-          {
-            if (irpacket_match (packets[x], packets[y], i))
-              break;
-          }
-        m[x + y * n_packets] = i;
-        m[y + x * n_packets] = i;
-        if (i > max_useful_jitter && i != jitter_max)
-          max_useful_jitter = i;
-      }
+  a.n_packets = n_packets;
+  a.packets = packets;
+  a.names = names;
+  a.name_packets = name_packets;
+  a.jitter_max = jitter_max;
+  analysis_group (&a);
+  a.max_useful_jitter = calloc (analysis_threads, sizeof *a.max_useful_jitter);
+  a.same_at = calloc (analysis_threads * (jitter_max + 1), sizeof *a.same_at);
+  a.diff_at = calloc (analysis_threads * (jitter_max + 1), sizeof *a.diff_at);
+  analysis_run (&a, analysis_matrix);
+  for (i = 0; i < analysis_threads; i++)
+    if (a.max_useful_jitter[i] > max_useful_jitter)
+      max_useful_jitter = a.max_useful_jitter[i];
 
   printf ("Jitter matrix:\n");
   for (y = 0; y < n_packets; y++)
     {
       for (x = 0; x < n_packets; x++)
-        printf ("%4d", m[x + y * n_packets]);
+        printf ("%4d", analysis_jitter (&a, x, y));
       printf ("\n");
     }
 
+  /* Fold the per-thread tallies into thread 0's */
+  analysis_run (&a, analysis_tally);
+  for (i = 1; i < analysis_threads; i++)
+    for (j = 0; j <= jitter_max; j++)
+      {
+        a.same_at[j] += a.same_at[i * (jitter_max + 1) + j];
+        a.diff_at[j] += a.diff_at[i * (jitter_max + 1) + j];
+      }
+  /* Every pair not tallied spans two groups, so never matches */
+  for (j = 0; j < jitter_max; j++)
+    {
+      total_same -= a.same_at[j];
+      total_pairs -= a.same_at[j] + a.diff_at[j];
+    }
+  a.same_at[jitter_max] = total_same;
+  a.diff_at[jitter_max] = total_pairs - total_same;
+  for (j = 0; j <= jitter_max; j++)
+    same_pairs += a.same_at[j];
+
   best_jitter = jitter_max;
   for (j = 0; j <= max_useful_jitter; j++)
     {
-      int mismatches = 0,       /* false mismatches */
+      long mismatches = 0,      /* false mismatches */
         ambiguous = 0;          /* false matches */
-      for (y = 0; y < n_packets; y++)
-        for (x = y; x < n_packets; x++)
-          {
-            bool match = m[x + y * n_packets] <= j;
-            bool same = (names[x] == names[y]);
-            if (match && !same)
-              {
-                if (j == 0)
-                  {
-                    printf ("Warning: entirely ambiguous data:\n");
-                    printf ("%s ", names[x]);
-                    irpacket_printf (stdout, packets[x]);
-                    printf (" matches\n%s ", names[y]);
-                    irpacket_printf (stdout, packets[x]);
-                    printf ("\n");
-                  }
-                ambiguous++;
-              }
-            else if (!match && same)
-              mismatches++;
-          }
-      printf ("At jitter=%d, false mismatches=%d, ambiguous=%d\n",
+      if (j == 0 && a.diff_at[0])
+        for (y = 0; y < n_packets; y++)
+          for (i = a.group_pos[y]; i < a.group_size[a.group[y]]; i++)
+            {
+              x = a.group_members[a.group[y]][i];
+              if (analysis_jitter (&a, x, y) == 0 && names[x] != names[y])
+                {
+                  printf ("Warning: entirely ambiguous data:\n");
+                  printf ("%s ", names[x]);
+                  irpacket_printf (stdout, packets[x]);
+                  printf (" matches\n%s ", names[y]);
+                  irpacket_printf (stdout, packets[x]);
+                  printf ("\n");
+                }
+            }
+      same_within += a.same_at[j];
+      diff_within += a.diff_at[j];
+      mismatches = same_pairs - same_within;
+      ambiguous = diff_within;
+      printf ("At jitter=%d, false mismatches=%ld, ambiguous=%ld\n",
               j, mismatches, ambiguous);
       if (j == 0 || ambiguous + mismatches < best_jitter_score)
         {
@@ -253,7 +737,7 @@ analyse_packet_files (int n, char **name)
         }
     }
 
-  printf ("Best jitter is %d with a badness of %d\n",
+  printf ("Best jitter is %d with a badness of %ld\n",
           best_jitter, best_jitter_score);
 
   printf ("Optimising key codes\n");
@@ -272,36 +756,21 @@ analyse_packet_files (int n, char **name)
       for (i = 0; i < n; i++)
         {
           best_packet_score = -1;
+          a.fname = files[i]->fname;
+          a.keep = keep;
+          a.scores = scores;
+          a.best_jitter = best_jitter;
+          analysis_run (&a, analysis_score);
           for (x = 0; x < n_packets; x++)
             {
-              int x_score = 0;
+              int x_score = scores[x];
               if (!keep[x])
                 continue;
               if (names[x] != files[i]->fname)
                 continue;
-              for (y = 0; y < n_packets; y++)
-                {
-                  bool match, same;
-                  if (x == y)
-                    continue;
-                  match = m[x + y * n_packets] <= best_jitter;
-                  same = names[x] == names[y];
-                  if (match && same && keep[y])
-                    /* In this round, only score it if it helps us
-                       narrow the field */
-                    x_score++;
-                  else if (match && !same)
-                    x_score -= 1;       /* penalise false + */
-                  else if (!match && same)
-                    ;           /* Probably two distinct patterns
-                                   from one key. Don't penalise. */
-                  else if (!match && !same)
-                    x_score++;
-                }
               printf ("%s ", names[x]);
               irpacket_printf (stdout, packets[x]);
               printf (" score=%d\n", x_score);
-              scores[x] = x_score;
               if (x_score > best_packet_score || best_packet_score < 0)
                 {
                   best_packet_score = x_score;
@@ -328,7 +797,7 @@ analyse_packet_files (int n, char **name)
                  unnecessary? */
               printf ("Do we need packet %d?\n", x);
               for (k = 0; k < n_kept_packets; k++)
-                if (m[kept_packets[k] + x * n_packets] <= best_jitter)
+                if (analysis_jitter (&a, kept_packets[k], x) <= best_jitter)
                   {
                     keep[x] = false;
                     changed = true;
@@ -351,9 +820,12 @@ analyse_packet_files (int n, char **name)
      above code, the duplicates serve to weight the scores. */
   for (x = 0; x < n_packets; x++)
     if (keep[x] && scores[x] > 0)
-      for (y = x + 1; y < n_packets; y++)
-        if (irpacket_match (packets[x], packets[y], 0))
-          keep[y] = false;
+      for (i = a.group_pos[x] + 1; i < a.group_size[a.group[x]]; i++)
+        {
+          y = a.group_members[a.group[x]][i];
+          if (analysis_jitter (&a, x, y) == 0)
+            keep[y] = false;
+        }
 
   /* Dump out 'canonical' packets */
   {
@@ -372,6 +844,47 @@ analyse_packet_files (int n, char **name)
     printf ("# kept %d of %d packets\n", kept, n_packets);
   }
 
+  /* Each key's packets that decode, as one line per code */
+  {
+    IRCode *codes = malloc ((n_packets + 1) * sizeof *codes);
+    int *counts = malloc ((n_packets + 1) * sizeof *counts);
+    printf ("# Decoded packet list:\n");
+    for (i = 0; i < n; i++)
+      {
+        int n_codes = 0, c;
+        for (j = 0; j < files[i]->n_packets; j++)
+          {
+            IRCode code;
+            if (!irpacket_decode (files[i]->packets[j], &code))
+              continue;
+            for (c = 0; c < n_codes; c++)
+              if (codes[c].protocol == code.protocol
+                  && codes[c].address == code.address
+                  && codes[c].command == code.command)
+                break;
+            if (c == n_codes)
+              {
+                codes[n_codes++] = code;
+                counts[c] = 0;
+              }
+            counts[c]++;
+          }
+        for (c = 0; c < n_codes; c++)
+          printf ("keycode %s %s 0x%x 0x%x # %d of %d packets\n",
+                  files[i]->fname, irprotocol_name (codes[c].protocol),
+                  codes[c].address, codes[c].command, counts[c],
+                  files[i]->n_packets);
+      }
+    free (codes);
+    free (counts);
+  }
+
+  free (a.max_useful_jitter);
+  free (a.same_at);
+  free (a.diff_at);
+  analysis_free (&a);
+  free_irclusters (clusters);
+  free (name_packets);
 }
 
 
@@ -401,12 +914,12 @@ log_packet (IRPacket * k)
 {
   static int counter = 1;
   static IRDict *d;
-  const char *name;
+  int id;
   if (!d)
     d = new_irdict ();
-  name = irdict_lookup_packet (d, k);
-  if (name)
-    fprintf (stdout, "(Duplicate packet '%s')\n", name);
+  id = irdict_lookup_packet (d, k);
+  if (id >= 0)
+    fprintf (stdout, "(Duplicate packet '%s')\n", irdict_name (d, id));
   else
     {
       char buffer[BUFSIZ];
@@ -421,7 +934,7 @@ test_main (int argc, char *argv[])
 {
   IRState *ir = new_irstate ();
   IRPacket *k;
-  IRPacket *out_packets[1];
+  IRPacket *out_packets[sizeof (test_chars) / 2 + 1];
   int n, i;
 
   n = irstate_rxbytes (ir, sizeof (test_chars), test_chars, out_packets);
@@ -463,6 +976,44 @@ test_main (int argc, char *argv[])
 
 typedef struct IRConnectionInfo IRConnectionInfo;
 typedef struct IRServerInfo IRServerInfo;
+typedef struct IRTransmit IRTransmit;
+typedef struct Config Config;
+typedef struct ConfigTuning ConfigTuning;
+typedef struct ServerOpts ServerOpts;
+
+/* Timing options. The decode and action threads each copy theirs in
+   when they switch to a config, so a reload never writes the values
+   under a running thread. */
+struct ConfigTuning
+{
+  int jitter, gap, grid;        /* decode thread; gap also when sending */
+  int packet_timeout;
+  int debounce_time;
+  int transmit_timeout;
+  int write_limit;
+  ConnectionOverflow write_overflow;
+};
+
+/* Everything read from the config and button dictionary */
+struct Config
+{
+  atomic_int refs;              /* see config_unref */
+  IRDict *buttondict;
+  Keymap **keymaps;
+  int n_keymaps;
+  Keymap *last_keymap;          /* most recently defined */
+  int repeat_id;                /* of the "REPEAT" button */
+  int packet_pulses;            /* 0 if not set */
+  bool early_dispatch;
+  char **sources;               /* files it was read from */
+  int n_sources;
+  ConfigTuning tuning;
+
+  /* The cache it was replayed from, if it was. Names, widths and
+     operands point into it. */
+  void *cache_map;
+  size_t cache_size;
+};
 
 struct IRConnectionInfo {
   IRServerInfo *si;
@@ -470,31 +1021,136 @@ struct IRConnectionInfo {
   char *end;
 };
 
+/* A frame waiting to go out on the IR device. Frames belong to the
+   button dictionary, so it holds a reference to CONFIG. */
+struct IRTransmit {
+  IRTransmit *next;
+  const IRFrame *frame;
+  Config *config;
+};
+
+/* Single-producer single-consumer ring of fixed-size slots. Either end
+   may sleep on COND until the other moves. */
+typedef struct Ring Ring;
+struct Ring
+{
+  unsigned n_slots;             /* a power of two */
+  size_t slot_size;
+  char *slots;
+  atomic_uint head;             /* next slot to fill */
+  atomic_uint tail;             /* next slot to drain */
+  atomic_int sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* Size of a single read from the IR device. Every pulse is two
+   bytes, so a read can complete at most half as many packets. */
+#define IR_READ_SIZE 4096
+
+/* What the event loop hands the decode thread, in device order */
+typedef enum RxType {
+  rx_bytes, rx_timeout, rx_expect_ack, rx_cancel_ack, rx_reload
+} RxType;
+
+typedef struct RxSlot RxSlot;
+struct RxSlot
+{
+  RxType type;
+  int n_bytes;
+  unsigned char bytes[IR_READ_SIZE];
+  Config *config;               /* rx_reload */
+};
+
+/* What the decode thread hands the action thread */
+typedef struct ActionSlot ActionSlot;
+struct ActionSlot
+{
+  int button;                   /* name id, -1 to end a run of repeats */
+  Config *config;               /* if not NULL, switch to it first */
+};
+
+#define RX_SLOTS 64
+#define RX_RESERVE 8            /* rx slots kept for timeouts and acks */
+#define ACTION_SLOTS 64
+
+/* The decode thread's IRState and IRDict counters, copied out after
+   each slot so "?stats" can read them from the event loop */
+typedef struct DecodeStats DecodeStats;
+struct DecodeStats
+{
+  atomic_int pool_size;
+  atomic_int pool_in_use;
+  atomic_int pool_high_water;
+  atomic_int pool_pulses;
+  atomic_int pool_spills;
+  atomic_long code_hits;
+  atomic_long grid_hits;
+  atomic_long slow_lookups;
+  atomic_long slow_hits;
+};
+
 struct IRServerInfo {
   Server *server;
-  Dict *keymaps;                /* name -> Keymap* */
+  ServerOpts *opts;
+  /* The config the event loop and action thread use, and the one the
+     decode thread uses. They differ while a reload is on its way down
+     the pipeline. */
+  Config *config;
+  Config *rx_config;
   Keymap *current_keymap;
 
-  IRDict *buttondict;
   IRState *ir;
   Connection *mythremote;
   Connection *irdev;
   Connection *vlc;
   Connection *uinput;
   FILE *out_file;
+  CommandHelper *osascript;     /* for applescript and keypress */
+  CommandHelper *shell;         /* for shell */
 
   /* Key debouncing */
-  const char *last_button;
+  int last_button;               /* name id, or -1 */
   struct timeval last_button_time;
   struct timeval next_repeat_time; /* earliest time of next repeat button */
 
+  /* Transmit queue. Only the first frame is ever in flight: the next
+     one is sent once the IRToy has answered. */
+  IRTransmit *tx_first;
+  IRTransmit *tx_last;
+  bool tx_in_flight;
+  struct timeval tx_time;       /* when the frame in flight was sent */
+
   bool verbose;
 
   char *unknown_key;
+
+  /* Receive pipeline, see below */
+  pthread_mutex_t lock;         /* held by the event loop except in waits */
+  pthread_mutex_t out_lock;     /* out_file and unknown_key */
+  Ring rx_ring;                 /* RxSlot: event loop -> decode */
+  Ring action_ring;             /* ActionSlot: decode -> action */
+  int wake_fd[2];               /* decode/action -> event loop */
+  int watch_fd;                 /* inotify on the config's files, or -1 */
+  Connection *watch;
+  Config *watch_config;         /* the config being watched */
+  int *watch_wds;               /* per source of watch_config */
+  int n_watch_wds;
+  int start_dir;                /* relative config paths are from here */
+  atomic_int acks_pending;
+  atomic_bool rx_stalled;       /* stopped reading, rx_ring full */
+  long rx_stalls;
+  long rx_dropped;              /* control events lost to a full ring */
+  atomic_long action_stalls;
+  atomic_long early_dispatches; /* buttons sent before the packet ended */
+  DecodeStats decode_stats;
 };
 
-bool handle_button (IRServerInfo *si, const char *button);
-IRPacket *transmit_button (IRServerInfo *si, const char *button);
+bool handle_button (IRServerInfo *si, int button);
+static void pipeline_event (IRServerInfo *si, RxType type);
+static bool config_reload (IRServerInfo *si);
+static volatile sig_atomic_t reload_requested;  /* by SIGHUP */
+IRPacket *transmit_button (IRServerInfo *si, int button, int repeats);
 
 bool mythremote_command (IRServerInfo *si, const char *command);
 bool vlc_command (IRServerInfo *si, const char *command);
@@ -509,16 +1165,46 @@ new_irserverinfo (void)
 {
   IRServerInfo *si = malloc (sizeof *si);
   /* IR specific stuff */
-  si->buttondict = NULL;
-  si->keymaps = dict_new (NULL);
+  si->opts = NULL;
+  si->config = NULL;
+  si->rx_config = NULL;
   si->current_keymap = NULL;
   si->ir = NULL;
   si->mythremote = NULL;
   si->out_file = NULL;
-  si->last_button = NULL;
+  si->last_button = -1;
+  si->tx_first = NULL;
+  si->tx_last = NULL;
+  si->tx_in_flight = false;
   si->uinput = NULL;
+  si->osascript = NULL;
+  si->shell = NULL;
   si->verbose = false;
   si->unknown_key = NULL;
+  pthread_mutex_init (&si->lock, NULL);
+  pthread_mutex_init (&si->out_lock, NULL);
+  si->wake_fd[0] = si->wake_fd[1] = -1;
+  si->watch_fd = -1;
+  si->watch = NULL;
+  si->watch_config = NULL;
+  si->watch_wds = NULL;
+  si->n_watch_wds = 0;
+  si->start_dir = -1;
+  atomic_init (&si->acks_pending, 0);
+  atomic_init (&si->rx_stalled, false);
+  si->rx_stalls = 0;
+  si->rx_dropped = 0;
+  atomic_init (&si->action_stalls, 0);
+  atomic_init (&si->early_dispatches, 0);
+  atomic_init (&si->decode_stats.pool_size, 0);
+  atomic_init (&si->decode_stats.pool_in_use, 0);
+  atomic_init (&si->decode_stats.pool_high_water, 0);
+  atomic_init (&si->decode_stats.pool_pulses, 0);
+  atomic_init (&si->decode_stats.pool_spills, 0);
+  atomic_init (&si->decode_stats.code_hits, 0);
+  atomic_init (&si->decode_stats.grid_hits, 0);
+  atomic_init (&si->decode_stats.slow_lookups, 0);
+  atomic_init (&si->decode_stats.slow_hits, 0);
   return si;
 }
 
@@ -545,6 +1231,39 @@ new_cmdconnection (IRServerInfo *si, int fd, IRConnectionInfo *ci)
  * Command server
  */
 
+/* "?stats": report internal counters */
+void
+write_stats (IRServerInfo *si, Connection * n)
+{
+  char buffer[BUFSIZ];
+  DecodeStats *ds = &si->decode_stats;
+  sprintf (buffer, "packet pool: size %d in use %d high water %d"
+           " inline pulses %d spills %d\n",
+           atomic_load (&ds->pool_size), atomic_load (&ds->pool_in_use),
+           atomic_load (&ds->pool_high_water),
+           atomic_load (&ds->pool_pulses), atomic_load (&ds->pool_spills));
+  connection_write (n, buffer, strlen (buffer));
+  sprintf (buffer, "lookups: code hits %ld grid hits %ld"
+           " slow %ld slow hits %ld\n",
+           atomic_load (&ds->code_hits), atomic_load (&ds->grid_hits),
+           atomic_load (&ds->slow_lookups), atomic_load (&ds->slow_hits));
+  connection_write (n, buffer, strlen (buffer));
+  sprintf (buffer, "early dispatches: %ld\n",
+           atomic_load (&si->early_dispatches));
+  connection_write (n, buffer, strlen (buffer));
+  sprintf (buffer, "pipeline: rx stalls %ld rx dropped %ld"
+           " action stalls %ld\n",
+           si->rx_stalls, si->rx_dropped, atomic_load (&si->action_stalls));
+  connection_write (n, buffer, strlen (buffer));
+  if (si->osascript)
+    {
+      command_helper_describe (si->osascript, buffer);
+      connection_write (n, buffer, strlen (buffer));
+      command_helper_describe (si->shell, buffer);
+      connection_write (n, buffer, strlen (buffer));
+    }
+}
+
 void
 can_read_command (Connection * n, void *h)
 {
@@ -566,7 +1285,7 @@ can_read_command (Connection * n, void *h)
           else
             {
               char str[] = "Error: command buffer overrun\n\n";
-              write (fd, str, sizeof (str) - 1);
+              connection_write (n, str, sizeof (str) - 1);
               count = 0;        /* => close connection */
               break;
             }
@@ -578,10 +1297,12 @@ can_read_command (Connection * n, void *h)
 	  /* ">symname" to transmit 'symname' */
           if (ci->buffer[0] == '>')
             {
-              k = transmit_button (ci->si, ci->buffer+1);
+              k = transmit_button (ci->si,
+                                   irdict_name_id (ci->si->config->buttondict,
+                                                   ci->buffer + 1), 1);
               if (k)
                 {
-                  write (fd, "ok\n", 3);
+                  connection_write (n, "ok\n", 3);
                   if (ci->si->verbose)
                     {
                       fprintf (stdout, "Command '%s' gets packet: ", ci->buffer);
@@ -595,24 +1316,44 @@ can_read_command (Connection * n, void *h)
                 {
                   char b2[BUFSIZ];
                   sprintf (b2, "Unknown button '%s'\n", ci->buffer);
-                  write (fd, b2, strlen (b2));
+                  connection_write (n, b2, strlen (b2));
                 }
             }
+	  /* "?stats" for internal counters */
+          else if (!strcmp (ci->buffer, "?stats"))
+            write_stats (ci->si, n);
+	  /* "?reload" to read the config again */
+          else if (!strcmp (ci->buffer, "?reload"))
+            {
+              if (config_reload (ci->si))
+                connection_write (n, "ok\n", 3);
+              else
+                connection_write (n, "Reload failed\n", 14);
+            }
 	  /* "=symname" to set the symbol for unknown packets to 'symname' */
           else if (ci->buffer[0] == '=')
             {
               if (ci->si->verbose)
                 fprintf (stdout, "Setting UNKWOWN key to '%s'\n", &ci->buffer[1]);
+              pthread_mutex_lock (&ci->si->out_lock);
               if (ci->si->unknown_key)
                 free (ci->si->unknown_key);
               ci->si->unknown_key = strdup (&ci->buffer[1]);
+              pthread_mutex_unlock (&ci->si->out_lock);
             }
           else
             {
+              int id = irdict_name_id (ci->si->config->buttondict, ci->buffer);
               if (ci->si->verbose)
                 fprintf (stdout, "Command port gets '%s'\n", ci->buffer);
-              if (handle_button(ci->si, ci->buffer))
-                write (fd, "ok\n", 3);
+              if (id < 0)
+                {
+                  if (ci->si->verbose)
+                    fprintf (stdout, "Cannot find button '%s'\n",
+                             ci->buffer);
+                }
+              else if (handle_button (ci->si, id))
+                connection_write (n, "ok\n", 3);
             }
 
           ci->end = ci->buffer;
@@ -636,6 +1377,7 @@ can_read_cmdport (Connection * n, void *h)
   fcntl (nfd, F_SETFL, fcntl (nfd, F_GETFL) | O_NONBLOCK);
   n2 = new_cmdconnection (si, nfd,
 			  new_irconnectioninfo (si));
+  connection_set_write_limit (n2, ir_write_limit, ir_write_overflow);
   connection_set_can_read(n2, can_read_command);
 }
 
@@ -646,13 +1388,18 @@ can_read_cmdport (Connection * n, void *h)
 
 typedef enum ActionID {
   action_keypress, action_multitap, action_mythtv, action_transmit,
-  action_set_keymap, action_vlc, action_applescript, action_key_action
+  action_set_keymap, action_vlc, action_applescript, action_key_action,
+  action_shell
 } ActionID;
 
 struct Action
 {
   ActionID id;
   const char *operand;
+  int repeat;                   /* for transmit */
+  int button;                   /* for transmit and key_action, once
+                                   compiled */
+  Keymap *keymap;               /* for set_keymap, once compiled */
   Action *next;
 };
 
@@ -661,6 +1408,9 @@ new_action (ActionID id, const char *operand) {
   Action *a = malloc (sizeof *a);
   a->id = id;
   a->operand = operand;
+  a->repeat = 1;
+  a->button = -1;
+  a->keymap = NULL;
   a->next = NULL;
   return a;
 }
@@ -672,153 +1422,402 @@ struct InheritedKeymap {
   InheritedKeymap *next;
 };
 
+/* One "key" line of a keymap */
+typedef struct KeymapKey KeymapKey;
+struct KeymapKey {
+  char *button;
+  Action *actions;
+};
+
 struct Keymap {
   const char *name;
   InheritedKeymap *inherit;
-  Dict *mapping;                /* char* -> Action* */
+  KeymapKey *keys;              /* in order, a later one for a button
+                                   replacing an earlier one */
+  int n_keys;
+  int n_keys_allocated;
+
+  /* Compiled by keymaps_compile: the action for every button id,
+     inherited ones included */
+  Action **table;
+  int n_table;
+  int compile_state;            /* 0 not yet, 1 in progress, 2 done */
 };
 
 Keymap *
 new_keymap (const char *name) {
   Keymap *km = malloc (sizeof *km);
   km->name = strdup (name);
-  km->mapping = dict_new (NULL);
+  km->keys = NULL;
+  km->n_keys = 0;
+  km->n_keys_allocated = 0;
   km->inherit = NULL;
+  km->table = NULL;
+  km->n_table = 0;
+  km->compile_state = 0;
   return km;
 }
 
 void
 keymap_add_action (Keymap *m, const char *k, Action *a) {
-  dict_set (m->mapping, k, a);
+  if (m->n_keys == m->n_keys_allocated)
+    {
+      m->n_keys_allocated = m->n_keys_allocated
+        ? 2 * m->n_keys_allocated : 16;
+      m->keys = realloc (m->keys, m->n_keys_allocated * sizeof *m->keys);
+    }
+  m->keys[m->n_keys].button = strdup (k);
+  m->keys[m->n_keys].actions = a;
+  m->n_keys++;
 }
 
+/* Add MAPNAME, which it takes, to the end of M's inherit list */
+void
+keymap_inherit (Keymap *m, const char *mapname) {
+  InheritedKeymap **tail = &m->inherit;
+  while (*tail)
+    tail = &(*tail)->next;
+  *tail = malloc (sizeof **tail);
+  (*tail)->mapname = mapname;
+  (*tail)->next = NULL;
+  (*tail)->map = NULL;
+}
 
-/* ------------------------------------------------------------
- * Options and Config File
- */
+/* Free KM. Its operands and inherited keymap names are freed too if
+   OWNS_DATA, as they are when it's parsed rather than replayed from
+   the cache. */
+void
+free_keymap (Keymap *km, bool owns_data)
+{
+  InheritedKeymap *ikm, *inext;
+  Action *a, *anext;
+  int i;
+  for (ikm = km->inherit; ikm; ikm = inext)
+    {
+      inext = ikm->next;
+      if (owns_data)
+        free ((char *) ikm->mapname);
+      free (ikm);
+    }
+  for (i = 0; i < km->n_keys; i++)
+    {
+      for (a = km->keys[i].actions; a; a = anext)
+        {
+          anext = a->next;
+          if (owns_data)
+            free ((char *) a->operand);
+          free (a);
+        }
+      free (km->keys[i].button);
+    }
+  free (km->keys);
+  free (km->table);
+  free ((char *) km->name);
+  free (km);
+}
 
-typedef struct ServerOpts ServerOpts;
-struct ServerOpts
+/* The built-in timing, taken before any config is applied */
+static ConfigTuning default_tuning;
+static bool default_tuning_set;
+
+/* Everything the config files define. A reload builds a new one to
+   the side and swaps it in whole. */
+Config *
+new_config (void)
 {
-  char *config_file;
-  char *irdev;
-  int cmdport;
-  char *frontend_host;
-  int frontend_port;
-  char *vlc_host;
-  int vlc_port;
-  char *out_file;
-  bool verbose;
-  char *uinput_dev;
-  char *buttondict_fname;  
-  bool daemon;
-};
+  Config *cfg = malloc (sizeof *cfg);
+  if (!default_tuning_set)
+    {
+      default_tuning.jitter = irtoy_jitter;
+      default_tuning.gap = irtoy_gap;
+      default_tuning.grid = irtoy_grid;
+      default_tuning.packet_timeout = ir_packet_timeout;
+      default_tuning.debounce_time = ir_debounce_time;
+      default_tuning.transmit_timeout = ir_transmit_timeout;
+      default_tuning.write_limit = ir_write_limit;
+      default_tuning.write_overflow = ir_write_overflow;
+      default_tuning_set = true;
+    }
+  atomic_init (&cfg->refs, 1);
+  cfg->buttondict = new_irdict ();
+  cfg->keymaps = NULL;
+  cfg->n_keymaps = 0;
+  cfg->last_keymap = NULL;
+  cfg->repeat_id = -1;
+  cfg->packet_pulses = 0;
+  cfg->early_dispatch = false;
+  cfg->sources = NULL;
+  cfg->n_sources = 0;
+  cfg->tuning = default_tuning;
+  cfg->cache_map = NULL;
+  cfg->cache_size = 0;
+  return cfg;
+}
 
-/* Config file format is:
+/* Configs are shared by the threads and the transmit queue, each
+   holding a reference. The last one out frees it. */
+Config *
+config_ref (Config *cfg)
+{
+  atomic_fetch_add (&cfg->refs, 1);
+  return cfg;
+}
+
+void
+config_unref (Config *cfg)
+{
+  bool owns_data;
+  int i;
+  if (!cfg || atomic_fetch_sub (&cfg->refs, 1) > 1)
+    return;
+  owns_data = !cfg->cache_map;
+  for (i = 0; i < cfg->n_keymaps; i++)
+    free_keymap (cfg->keymaps[i], owns_data);
+  free (cfg->keymaps);
+  free_irdict (cfg->buttondict, owns_data);
+  for (i = 0; i < cfg->n_sources; i++)
+    free (cfg->sources[i]);
+  free (cfg->sources);
+  if (cfg->cache_map)
+    munmap (cfg->cache_map, cfg->cache_size);
+  free (cfg);
+}
+
+/* The keymap called NAME, or NULL */
+Keymap *
+config_keymap (Config *cfg, const char *name)
+{
+  int i;
+  for (i = 0; i < cfg->n_keymaps; i++)
+    if (!strcmp (cfg->keymaps[i]->name, name))
+      return cfg->keymaps[i];
+  return NULL;
+}
+
+/* Add KM, replacing any keymap of the same name, and start in it */
+void
+config_add_keymap (Config *cfg, Keymap *km)
+{
+  int i;
+  for (i = 0; i < cfg->n_keymaps; i++)
+    if (!strcmp (cfg->keymaps[i]->name, km->name))
+      break;
+  if (i < cfg->n_keymaps)
+    free_keymap (cfg->keymaps[i], !cfg->cache_map);
+  else
+    cfg->keymaps = realloc (cfg->keymaps,
+                            ++cfg->n_keymaps * sizeof *cfg->keymaps);
+  cfg->keymaps[i] = km;
+  cfg->last_keymap = km;
+}
+
+void
+config_add_source (Config *cfg, const char *file)
+{
+  cfg->sources = realloc (cfg->sources,
+                          (cfg->n_sources + 1) * sizeof *cfg->sources);
+  cfg->sources[cfg->n_sources++] = strdup (file);
+}
+
+/* Intern the buttons an action sequence refers to, and resolve the
+   keymaps it switches to */
+static void
+actions_compile (Config *cfg, Keymap *km, Action *a)
+{
+  for (; a; a = a->next)
+    switch (a->id)
+      {
+      case action_key_action:
+      case action_transmit:
+        a->button = irdict_intern (cfg->buttondict, a->operand);
+        break;
+      case action_set_keymap:
+        a->keymap = config_keymap (cfg, a->operand);
+        if (!a->keymap)
+          warning ("Keymap '%s' switches to unknown keymap '%s'\n",
+                   km->name, a->operand);
+        break;
+      default:
+        break;
+      }
+}
+
+/* Flatten KM's table: its own actions, then each inherited keymap's
+   in order, so the first found wins as in a depth-first search */
+static void
+keymap_compile (Config *cfg, Keymap *km)
+{
+  InheritedKeymap *ikm;
+  int i;
+
+  if (km->compile_state == 2)
+    return;
+  if (km->compile_state == 1)
+    fatal (0, "Keymap '%s' inherits itself, directly or indirectly\n",
+           km->name);
+  km->compile_state = 1;
+  km->n_table = cfg->buttondict->n_names;
+  km->table = calloc (km->n_table ? km->n_table : 1, sizeof *km->table);
+  for (i = 0; i < km->n_keys; i++)
+    km->table[irdict_name_id (cfg->buttondict, km->keys[i].button)]
+      = km->keys[i].actions;
+  for (ikm = km->inherit; ikm; ikm = ikm->next)
+    {
+      ikm->map = config_keymap (cfg, ikm->mapname);
+      if (!ikm->map)
+        fatal (0, "Keymap '%s' inherits unknown keymap '%s'\n",
+               km->name, ikm->mapname);
+      keymap_compile (cfg, ikm->map);
+      for (i = 0; i < km->n_table; i++)
+        if (!km->table[i])
+          km->table[i] = ikm->map->table[i];
+    }
+  km->compile_state = 2;
+}
+
+/* Once the config and button dictionary are read: give every button
+   a keymap mentions an id (keycodes already have one), then build
+   each keymap's table */
+void
+keymaps_compile (Config *cfg)
+{
+  int i, j;
+
+  cfg->repeat_id = irdict_intern (cfg->buttondict, "REPEAT");
+  for (i = 0; i < cfg->n_keymaps; i++)
+    {
+      Keymap *km = cfg->keymaps[i];
+      for (j = 0; j < km->n_keys; j++)
+        {
+          irdict_intern (cfg->buttondict, km->keys[j].button);
+          actions_compile (cfg, km, km->keys[j].actions);
+        }
+    }
+  for (i = 0; i < cfg->n_keymaps; i++)
+    keymap_compile (cfg, cfg->keymaps[i]);
+}
+
+
+/* ------------------------------------------------------------
+ * Options and Config File
+ */
+
+struct ServerOpts
+{
+  char *config_file;
+  char *irdev;
+  int cmdport;
+  char *frontend_host;
+  int frontend_port;
+  char *vlc_host;
+  int vlc_port;
+  char *out_file;
+  bool verbose;
+  char *uinput_dev;
+  char *buttondict_fname;  
+  bool daemon;
+  char *cache_file;             /* compiled config, NULL for none */
+  FILE *cache;                  /* while writing it */
+};
+
+/* Config file format is:
  * file ::= entry*
  * entry ::= '#' comment
  *         | "irdev" string
  *         | "frontend" string
  *         | "frontend_port" integer
- *         | "keycode" string packet
+ *         | "early_dispatch" integer
+ *         | "grid" integer
+ *         | "keycode" string ( packet | code )
  *         | "cmdport" integer
  *         | "include" string
  *         | "out_file" string
+ *         | "packet_pulses" integer
+ *         | "transmit_timeout" integer
+ *         | "write_limit" integer
+ *         | "write_overflow" ( "drop" | "disconnect" )
  * XXX out of date....
  * packet ::= " { " integer* " } "
+ * code ::= protocol integer integer   (address and command)
  */
 
+/* The next token as a new string: WHAT describes it for errors */
 char *
-read_string (FILE * in)
+read_string (Lexer * lx, const char *what)
 {
-  char buffer[BUFSIZ], *b = buffer;
-  char c;
-  char end = ' ';
-  if (feof (in))
-    return NULL;
-  c = fgetc (in);
-  while (isspace (c))
-    c = fgetc (in);
-  if (c == '#')
-    {
-      /* Comment until end of line. */
-      for (;;)
-        {
-          c = fgetc (in);
-          if (c == '\n' || feof (in))
-            /* Now read the next string. */
-            return read_string (in);
-        }
-    }
-  if (c == '\"' || c == '\'')
-    end = c;
-  else
-    {
-      /* c is first char of string */
-      end = ' ';
-      *b++ = c;
-    }
-  while (!feof (in))
-    {
-      c = fgetc (in);
-      if (c == end || (end == ' ' && isspace (c)))
-        break;
-      *b++ = c;
-    }
-  *b++ = '\0';
-  return strdup (buffer);
+  Token t;
+  lexer_expect (lx, &t, what);
+  return token_strdup (&t);
 }
 
 int
-read_integer (FILE * in)
+read_integer (Lexer * lx, const char *what)
+{
+  Token t;
+  lexer_expect (lx, &t, what);
+  return lexer_integer (lx, &t, 10);
+}
+
+static void config_cache_source (ServerOpts *opts, const char *file);
+static void config_cache_keycode (ServerOpts *opts, IRSymbol *s);
+static void config_cache_option (ServerOpts *opts, const char *keyword,
+                                 const Token *value);
+static void config_cache_keymap (ServerOpts *opts, Keymap *km);
+
+/* keycode <name> { <width>... }
+   keycode <name> <protocol> <address> <command> */
+void
+read_keycode (Lexer * lx, IRDict * d)
 {
-  char *str = read_string (in);
-  int rv;
-  if (!str)
-    return 0;
-  rv = atoi (str);
-  free (str);
-  return rv;
+  char *id = read_string (lx, "keycode name");
+  Token t;
+  IRCode code;
+  lexer_expect (lx, &t, "packet or protocol");
+  if (token_is (&t, "{"))
+    irdict_insert (d, id, irpacket_lex_widths (lx));
+  else
+    {
+      char protocol[32];
+      code.protocol = irprotocol_lookup (token_copy (&t, protocol,
+                                                     sizeof protocol));
+      if (code.protocol <= irproto_raw)
+        lexer_fatal (lx, &t, "Unknown protocol '%.*s' for keycode '%s'",
+                     t.len, t.text, id);
+      lexer_expect (lx, &t, "address");
+      code.address = lexer_integer (lx, &t, 0);
+      lexer_expect (lx, &t, "command");
+      code.command = lexer_integer (lx, &t, 0);
+      irdict_insert_code (d, id, &code);
+    }
 }
 
 /* Button dictionary IO */
 void
-read_buttondict (ServerOpts *opts, IRServerInfo *si, const char *file)
+read_buttondict (ServerOpts *opts, Config *cfg, const char *file)
 {
-  FILE *in;
+  Lexer *lx;
+  Token t;
   if (opts->verbose)
     fprintf (stdout, "Reading button dictionary file '%s'\n", file);
-  in = fopen(file, "r");
-  if (!in)
+  config_add_source (cfg, file);
+  config_cache_source (opts, file);
+  lx = lexer_open (file);
+  if (!lx)
     fatal(0, "Can't read button dictionary file '%s'\n", file);
-  while (!feof (in))
+  while (lexer_next (lx, &t))
     {
-      char buffer[BUFSIZ];
-      if (!fscanf (in, "%s", buffer) || feof (in))
-        break;
-      if (!strcmp (buffer, "keycode")) {
-        IRPacket *k;
-        char *id;
-        id = read_string (in);
-        k = irpacket_scanf (in);
-        irdict_insert (si->buttondict, id, k);
-      } else if (buffer[0] == '#') {
-        char c;
-        for (;;)
-          {
-            c = fgetc (in);
-            if (c == '\n' || feof (in))
-              break;
-          }
+      if (token_is (&t, "keycode")) {
+        read_keycode (lx, cfg->buttondict);
+        config_cache_keycode (opts, cfg->buttondict->first);
       } else {
-        fatal(0, "Unknown entry '%s' in button dictionary '%s'\n",
-              buffer, file);
+        lexer_fatal (lx, &t, "Unknown entry '%.*s' in button dictionary",
+                     t.len, t.text);
       }
     }
-  fclose (in);
+  lexer_close (lx);
 }
 
-void write_buttondict (ServerOpts *opts, IRServerInfo *si, const char *file)
+void write_buttondict (ServerOpts *opts, Config *cfg, const char *file)
 {
   FILE *out;
   IRSymbol *s;
@@ -828,7 +1827,7 @@ void write_buttondict (ServerOpts *opts, IRServerInfo *si, const char *file)
   out = fopen (file, "w");
   if (!out)
     fatal(0, "Can't write button dictionary file '%s'\n", file);
-  for (s = si->buttondict->first; s; s = s->next)
+  for (s = cfg->buttondict->first; s; s = s->next)
   {
     fprintf (out, "keycode %s ", s->name);
     irpacket_printf (out, s->packet);
@@ -839,27 +1838,35 @@ void write_buttondict (ServerOpts *opts, IRServerInfo *si, const char *file)
 
 /* Action IO */
 Action *
-read_action (FILE *in)
+read_action (Lexer *lx)
 {
-  char *id = read_string (in);
-  switch (decode_keyword(id)) {
+  Token t;
+  char id[32];
+  lexer_expect (lx, &t, "action");
+  switch (decode_keyword (token_copy (&t, id, sizeof id))) {
   case k_keypress:
-    return new_action(action_keypress, read_string (in));
+    return new_action(action_keypress, read_string (lx, "key"));
   case k_multitap:
-    return new_action(action_multitap, read_string (in));
+    return new_action(action_multitap, read_string (lx, "key"));
   case k_transmit:
-    return new_action(action_transmit, read_string (in));
+    return new_action(action_transmit, read_string (lx, "button"));
+  case k_transmit_repeat: {
+    /* transmit_repeat <button> <count> */
+    Action *a = new_action(action_transmit, read_string (lx, "button"));
+    a->repeat = read_integer (lx, "repeat count");
+    return a;
+  }
   case k_set_keymap:
-    return new_action(action_set_keymap, read_string (in));
+    return new_action(action_set_keymap, read_string (lx, "keymap name"));
   case k_vlc:
-    return new_action(action_vlc, read_string (in));
+    return new_action(action_vlc, read_string (lx, "VLC command"));
   case k_key_action:
-    return new_action(action_key_action, read_string (in));
+    return new_action(action_key_action, read_string (lx, "button"));
   case k_begin: {
     /* Read an action sequence */
     Action *a, *last_a = NULL, *first_a = NULL;
-    while (!feof (in)) {
-      a = read_action (in);
+    for (;;) {
+      a = read_action (lx);
       if (!first_a)
         first_a = a;
       if (last_a)
@@ -873,9 +1880,11 @@ read_action (FILE *in)
   case k_end:
     return NULL;
   case k_applescript:
-    return new_action (action_applescript, read_string (in));
+    return new_action (action_applescript, read_string (lx, "script"));
+  case k_shell:
+    return new_action (action_shell, read_string (lx, "command"));
   default:
-    fatal (0, "Unknown action '%s'\n", id);
+    lexer_fatal (lx, &t, "Unknown action '%.*s'", t.len, t.text);
   }
   return NULL;
 }
@@ -887,530 +1896,1714 @@ read_action (FILE *in)
   end
  */
 Keymap *
-read_keymap (FILE *in)
+read_keymap (Lexer *lx)
 {
-  char *id = read_string (in);
+  char *id = read_string (lx, "keymap name");
   Keymap *km = new_keymap (id);
   char *key_id;
   Action *action;
+  Token t;
+  char word[32];
   free (id);
-  while (!feof (in))
+  for (;;)
     {
-      id = read_string (in);
-      switch (decode_keyword (id))
+      if (!lexer_next (lx, &t))
+        lexer_fatal (lx, NULL, "Keymap '%s' has no 'end'", km->name);
+      switch (decode_keyword (token_copy (&t, word, sizeof word)))
         {
         case k_key:
-          free (id);
-          key_id = read_string (in);
-          action = read_action (in);
+          key_id = read_string (lx, "button");
+          action = read_action (lx);
           keymap_add_action (km, key_id, action);
           free (key_id);
           break;
         case k_end:
           /* Finish */
-          free (id);
           return km;
-          break;
         case k_inherit:
-          free (id);
           fprintf (stderr, "Adding inherit in keymap '%s'\n", km->name);
-          InheritedKeymap **tail = &(km->inherit);
-          while (*tail) {
-            fprintf (stderr, "  skip past map '%s'\n", (*tail)->mapname);
-            tail = &( (*tail)->next );
-          }
-          *tail = malloc (sizeof **tail);
-          (*tail)->mapname = read_string (in);
-          (*tail)->next = NULL;
-          (*tail)->map = NULL;
+          keymap_inherit (km, read_string (lx, "keymap name"));
           break;
         default:
-          fatal (1, "Unknown keyword '%s' in keymap '%s'", id, km->name);
-          return NULL;
+          lexer_fatal (lx, &t, "Unknown keyword '%.*s' in keymap '%s'",
+                       t.len, t.text, km->name);
         }
     }
-  return NULL;
+}
+
+/* Set config option KEYWORD to VALUE, from LX (NULL if it's from the
+   cache) */
+static void
+config_option (ServerOpts *opts, Config *cfg, Lexer *lx,
+               const char *keyword, const Token *value)
+{
+  char policy[32];
+  switch (decode_keyword (keyword))
+    {
+    case k_irdev:
+      opts->irdev = token_strdup (value);
+      break;
+    case k_frontend:
+      opts->frontend_host = token_strdup (value);
+      break;
+    case k_frontend_port:
+      opts->frontend_port = lexer_integer (lx, value, 10);
+      break;
+    case k_cmdport:
+      opts->cmdport = lexer_integer (lx, value, 10);
+      break;
+    case k_jitter:
+      cfg->tuning.jitter = lexer_integer (lx, value, 10);
+      break;
+    case k_gap:
+      cfg->tuning.gap = lexer_integer (lx, value, 10);
+      break;
+    case k_grid:
+      cfg->tuning.grid = lexer_integer (lx, value, 10);
+      break;
+    case k_packet_timeout:
+      cfg->tuning.packet_timeout = lexer_integer (lx, value, 10);
+      break;
+    case k_debounce_time:
+      cfg->tuning.debounce_time = lexer_integer (lx, value, 10);
+      break;
+    case k_packet_pulses:
+      cfg->packet_pulses = lexer_integer (lx, value, 10);
+      break;
+    case k_early_dispatch:
+      cfg->early_dispatch = lexer_integer (lx, value, 10) != 0;
+      break;
+    case k_transmit_timeout:
+      cfg->tuning.transmit_timeout = lexer_integer (lx, value, 10);
+      break;
+    case k_write_limit:
+      cfg->tuning.write_limit = lexer_integer (lx, value, 10);
+      break;
+    case k_write_overflow:
+      switch (decode_keyword (token_copy (value, policy, sizeof policy)))
+        {
+        case k_drop:
+          cfg->tuning.write_overflow = overflow_drop;
+          break;
+        case k_disconnect:
+          cfg->tuning.write_overflow = overflow_disconnect;
+          break;
+        default:
+          lexer_fatal (lx, value, "Unknown write_overflow policy '%.*s'",
+                       value->len, value->text);
+        }
+      break;
+    case k_out_file:
+      opts->out_file = token_strdup (value);
+      break;
+    case k_vlc_host:
+      opts->vlc_host = token_strdup (value);
+      break;
+    case k_vlc_port:
+      opts->vlc_port = lexer_integer (lx, value, 10);
+      break;
+    case k_uinput_dev:
+      opts->uinput_dev = token_strdup (value);
+      break;
+    case k_buttondict:
+      opts->buttondict_fname = token_strdup (value);
+      break;
+    default:
+      lexer_fatal (lx, value, "Unknown config file entry '%s'", keyword);
+    }
 }
 
 /* Config file IO */
 void
-read_config (ServerOpts *opts, IRServerInfo *si, const char *file)
+read_config (ServerOpts *opts, Config *cfg, const char *file)
 {
-  FILE *in;
+  Lexer *lx;
+  Token t, value;
+  char keyword[32];
 
   if (opts->verbose)
     fprintf (stdout, "Reading config file '%s'\n", file);
 
-  in = fopen (file, "r");
-  if (!in)
+  config_add_source (cfg, file);
+  config_cache_source (opts, file);
+  lx = lexer_open (file);
+  if (!lx)
     fatal (0, "Can't read config file '%s'", file);
-  while (!feof (in))
+  while (lexer_next (lx, &t))
     {
-      char buffer[BUFSIZ];
-      if (!fscanf (in, "%s", buffer) || feof (in))
-        break;
-
-      switch (decode_keyword(buffer))
+      switch (decode_keyword (token_copy (&t, keyword, sizeof keyword)))
         {
         case k_keycode:
+          read_keycode (lx, cfg->buttondict);
+          config_cache_keycode (opts, cfg->buttondict->first);
+          break;
+        case k_include:
           {
-            IRPacket *k;
-            char *id;
-            id = read_string (in);
-            k = irpacket_scanf (in);
-            irdict_insert (si->buttondict, id, k);
+            char *f = read_string (lx, "file name");
+            read_config (opts, cfg, f);
+            free (f);
             break;
           }
         case k_irdev:
-          opts->irdev = read_string (in);
-          break;
         case k_frontend:
-          opts->frontend_host = read_string (in);
-          break;
         case k_frontend_port:
-          opts->frontend_port = read_integer (in);
-          break;
         case k_cmdport:
-          opts->cmdport = read_integer (in);
-          break;
-        case k_include:
-          {
-            char *f = read_string (in);
-            read_config (opts, si, f);
-            free (f);
-            break;
-          }
         case k_jitter:
-          irtoy_jitter = read_integer (in);
-          break;
         case k_gap:
-          irtoy_gap = read_integer (in);
-          break;
+        case k_grid:
         case k_packet_timeout:
-          ir_packet_timeout = read_integer (in);
-          break;
         case k_debounce_time:
-          ir_debounce_time = read_integer (in);
-          break;
+        case k_packet_pulses:
+        case k_early_dispatch:
+        case k_transmit_timeout:
+        case k_write_limit:
+        case k_write_overflow:
         case k_out_file:
-          opts->out_file = read_string (in);
-          break;
         case k_vlc_host:
-          opts->vlc_host = read_string (in);
-          break;
         case k_vlc_port:
-          opts->vlc_port = read_integer (in);
-          break;
         case k_uinput_dev:
-          opts->uinput_dev = read_string (in);
-          break;
         case k_buttondict:
-          opts->buttondict_fname = read_string (in);
+          lexer_expect (lx, &value, "value");
+          config_cache_option (opts, keyword, &value);
+          config_option (opts, cfg, lx, keyword, &value);
           break;
 
         case k_keymap: {
-          Keymap *km = read_keymap (in);
-          dict_set(si->keymaps, km->name, km);
-          /* Set current keymap to most recently defined keymap */
-          si->current_keymap = km;
+          Keymap *km = read_keymap (lx);
+          config_cache_keymap (opts, km);
+          /* Start in the most recently defined keymap */
+          config_add_keymap (cfg, km);
           break;
         }
 
         default:
-          if (buffer[0] == '#')
-            {
-              /* Comment */
-              char c;
-              for (;;)
-                {
-                  c = fgetc (in);
-                  if (c == '\n' || feof (in))
-                    break;
-                }
-            }
-          else
-            fatal (0, "Unknown config file entry '%s'\n", buffer);
+          lexer_fatal (lx, &t, "Unknown config file entry '%.*s'",
+                       t.len, t.text);
         }
     }
-  fclose (in);
+  lexer_close (lx);
 }
 
-
 /* ------------------------------------------------------------
- * VLC remote connection
+ * Config cache
+ * What read_config and read_buttondict did, kept as a binary file
+ * that is mapped and replayed without parsing anything. It's used as
+ * long as every file it was read from is unchanged, and rewritten
+ * otherwise. As with binary captures (see irtoy.c) it's a 16 byte
+ * header followed by records padded to 8 bytes, in the writer's byte
+ * order:
+ *
+ *   header:  "IRTOYCFG", u16 version, u16 0x0102, u32 0
+ *   record:  u32 length, u16 type, u16 count, u64 value, payload
+ *
+ *   source   a file read; value its size, payload i64 mtime seconds,
+ *            i64 mtime nanoseconds, u64 inode, name. The first is the
+ *            config file.
+ *   option   payload keyword, value
+ *   keycode  count pulses, value protocol (irproto_raw if the packet
+ *            has no code); payload u32 address, u32 command, widths,
+ *            name
+ *   keymap   payload name; the inherits and keys up to the next
+ *            keymap are its own
+ *   inherit  payload keymap name
+ *   key      count actions, which follow; payload button name
+ *   action   count ActionID, value repeat; payload operand, empty if
+ *            there isn't one
+ *   end      the cache is complete
+ *
+ * Strings are NUL terminated. Widths and names are used in place, so
+ * the cache stays mapped as long as the Config replayed from it.
  */
-bool
-vlc_command (IRServerInfo *si, const char *command)
+
+#define CFGCACHE_MAGIC "IRTOYCFG"
+#define CFGCACHE_VERSION 2
+#define CFGCACHE_BOM 0x0102
+#define CFGCACHE_HEADER_LEN 16
+#define CFGCACHE_RECORD_LEN 16
+#define CFGCACHE_SOURCE_LEN 24
+#define CFGCACHE_KEYCODE_LEN 8
+#define CFGCACHE_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+enum
 {
-  Connection *n = si->vlc;
-  if (n)
+  cfgcache_source = 1,
+  cfgcache_option,
+  cfgcache_keycode,
+  cfgcache_keymap,
+  cfgcache_inherit,
+  cfgcache_key,
+  cfgcache_action,
+  cfgcache_end
+};
+
+struct ConfigCacheRecord
+{
+  uint32_t length;
+  uint16_t type;
+  uint16_t count;
+  uint64_t value;
+};
+
+static void
+config_cache_begin (FILE *out, int type, int count, uint64_t value,
+                    size_t length)
+{
+  struct ConfigCacheRecord r;
+  r.length = length;
+  r.type = type;
+  r.count = count;
+  r.value = value;
+  fwrite (&r, sizeof r, 1, out);
+}
+
+/* After the LENGTH bytes of payload */
+static void
+config_cache_pad (FILE *out, size_t length)
+{
+  static const unsigned char zeros[8];
+  fwrite (zeros, 1, CFGCACHE_ALIGN (length) - length, out);
+}
+
+/* A record with string S, or none if S is NULL, as its payload */
+static void
+config_cache_string (FILE *out, int type, int count, uint64_t value,
+                     const char *s)
+{
+  size_t length = s ? strlen (s) + 1 : 0;
+  config_cache_begin (out, type, count, value, length);
+  fwrite (s, 1, length, out);
+  config_cache_pad (out, length);
+}
+
+/* Before FILE is read, so that if it changes while it's read the
+   cache will be out of date */
+static void
+config_cache_source (ServerOpts *opts, const char *file)
+{
+  struct stat st;
+  int64_t times[2];
+  uint64_t inode;
+  size_t length = CFGCACHE_SOURCE_LEN + strlen (file) + 1;
+  if (!opts->cache)
+    return;
+  if (stat (file, &st))
     {
-      connection_write (n, command, strlen (command));
-      connection_write (n, "\n", 1);
-      if (si->verbose)
-        fprintf (stdout, "Sent command '%s' to VLC\n", command);
-      return true;
+      /* Reading it will fail */
+      errno = 0;
+      return;
     }
-  else
+  times[0] = st.st_mtim.tv_sec;
+  times[1] = st.st_mtim.tv_nsec;
+  inode = st.st_ino;
+  config_cache_begin (opts->cache, cfgcache_source, 0, st.st_size, length);
+  fwrite (times, sizeof times, 1, opts->cache);
+  fwrite (&inode, sizeof inode, 1, opts->cache);
+  fwrite (file, 1, strlen (file) + 1, opts->cache);
+  config_cache_pad (opts->cache, length);
+}
+
+static void
+config_cache_keycode (ServerOpts *opts, IRSymbol *s)
+{
+  uint32_t code[2] = { 0, 0 };
+  IRPacket *k = s->packet;
+  size_t length = CFGCACHE_KEYCODE_LEN + k->n_pulses * sizeof *k->widths
+    + strlen (s->name) + 1;
+  if (!opts->cache)
+    return;
+  if (k->n_pulses > 0xffff)
+    fatal (0, "Keycode '%s' is too long to cache", s->name);
+  if (s->has_code)
     {
-      return false;
+      code[0] = s->code.address;
+      code[1] = s->code.command;
     }
+  config_cache_begin (opts->cache, cfgcache_keycode, k->n_pulses,
+                      s->has_code ? s->code.protocol : irproto_raw, length);
+  fwrite (code, sizeof code, 1, opts->cache);
+  fwrite (k->widths, sizeof *k->widths, k->n_pulses, opts->cache);
+  fwrite (s->name, 1, strlen (s->name) + 1, opts->cache);
+  config_cache_pad (opts->cache, length);
 }
 
-void
-can_read_vlc (Connection *n, void *h)
+static void
+config_cache_option (ServerOpts *opts, const char *keyword,
+                     const Token *value)
 {
-  char buffer[BUFSIZ];
-  int fd = connection_fd (n);
-  int count = read (fd, buffer, BUFSIZ);
-  IRServerInfo *si = (IRServerInfo *)h;
+  size_t length;
+  if (!opts->cache)
+    return;
+  length = strlen (keyword) + 1 + value->len + 1;
+  config_cache_begin (opts->cache, cfgcache_option, 0, 0, length);
+  fwrite (keyword, 1, strlen (keyword) + 1, opts->cache);
+  fwrite (value->text, 1, value->len, opts->cache);
+  fwrite ("", 1, 1, opts->cache);
+  config_cache_pad (opts->cache, length);
+}
 
-  if (count == 0)
+static void
+config_cache_keymap (ServerOpts *opts, Keymap *km)
+{
+  InheritedKeymap *ikm;
+  int i;
+  if (!opts->cache)
+    return;
+  config_cache_string (opts->cache, cfgcache_keymap, 0, 0, km->name);
+  for (ikm = km->inherit; ikm; ikm = ikm->next)
+    config_cache_string (opts->cache, cfgcache_inherit, 0, 0, ikm->mapname);
+  for (i = 0; i < km->n_keys; i++)
     {
-      if (si->vlc != n)
-        fatal (0, "can_read_vlc(n): n != n->server->vlc");
-      si->vlc = NULL;
-      close (fd);
-      connection_remove (n);
+      Action *a;
+      int n = 0;
+      for (a = km->keys[i].actions; a; a = a->next)
+        n++;
+      config_cache_string (opts->cache, cfgcache_key, n, 0,
+                           km->keys[i].button);
+      for (a = km->keys[i].actions; a; a = a->next)
+        config_cache_string (opts->cache, cfgcache_action, a->id, a->repeat,
+                             a->operand);
     }
-  fprintf (stdout, "VLC response:\n");
-  fflush (stdout);
-  write (fileno (stdout), buffer, count);
-  fprintf (stdout, "\n");
 }
 
-Connection *
-open_vlc (IRServerInfo *si, char *host, int port)
+/* Start writing the cache alongside reading the config */
+static void
+config_cache_create (ServerOpts *opts)
 {
-  Connection *vlc;
-  int fd;
-  if (si->verbose)
-    fprintf (stdout, "Opening VLC port %s:%d\n", host, port);
-  vlc = connection_port (si->server, host, port, si);
-  if (!vlc)
-    return NULL;
-  fd = connection_fd (vlc);
-  if (fd == -1)
-    return NULL;
+  unsigned char header[CFGCACHE_HEADER_LEN] = CFGCACHE_MAGIC;
+  uint16_t version = CFGCACHE_VERSION, bom = CFGCACHE_BOM;
+  char *tmp = malloc (strlen (opts->cache_file) + 5);
+  sprintf (tmp, "%s.tmp", opts->cache_file);
+  opts->cache = fopen (tmp, "wb");
+  if (!opts->cache && opts->verbose)
+    fprintf (stdout, "Can't write config cache '%s'\n", tmp);
+  free (tmp);
+  if (!opts->cache)
+    return;
+  memcpy (header + 8, &version, sizeof version);
+  memcpy (header + 10, &bom, sizeof bom);
+  fwrite (header, sizeof header, 1, opts->cache);
+}
 
-  /* Set it non-blocking */
-  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
-  connection_set_can_read(vlc, can_read_vlc);
-  si->vlc = vlc;
-  return vlc;
+/* Put the finished cache in place */
+static void
+config_cache_finish (ServerOpts *opts)
+{
+  char *tmp = malloc (strlen (opts->cache_file) + 5);
+  bool ok;
+  sprintf (tmp, "%s.tmp", opts->cache_file);
+  config_cache_begin (opts->cache, cfgcache_end, 0, 0, 0);
+  ok = !ferror (opts->cache);
+  ok = !fclose (opts->cache) && ok;
+  opts->cache = NULL;
+  if (ok)
+    ok = !rename (tmp, opts->cache_file);
+  if (!ok)
+    {
+      if (opts->verbose)
+        fprintf (stdout, "Can't write config cache '%s'\n",
+                 opts->cache_file);
+      unlink (tmp);
+    }
+  errno = 0;
+  free (tmp);
 }
 
+/* Give up on the cache being written */
+static void
+config_cache_abort (ServerOpts *opts)
+{
+  char *tmp = malloc (strlen (opts->cache_file) + 5);
+  sprintf (tmp, "%s.tmp", opts->cache_file);
+  fclose (opts->cache);
+  opts->cache = NULL;
+  unlink (tmp);
+  errno = 0;
+  free (tmp);
+}
 
-/* ------------------------------------------------------------
- * Myth remote connection
- */
+/* Step to the next record, returning false at the end or if it's
+   truncated */
+static bool
+config_cache_next (const unsigned char *map, size_t size, size_t *pos,
+                   struct ConfigCacheRecord *r, const unsigned char **payload)
+{
+  if (size - *pos < CFGCACHE_RECORD_LEN)
+    return false;
+  memcpy (r, map + *pos, sizeof *r);
+  *pos += CFGCACHE_RECORD_LEN;
+  if (size - *pos < CFGCACHE_ALIGN (r->length))
+    return false;
+  *payload = map + *pos;
+  *pos += CFGCACHE_ALIGN (r->length);
+  return true;
+}
+
+/* Is the cache complete and well formed, and every file it came from
+   unchanged? */
+static bool
+config_cache_fresh (ServerOpts *opts, const unsigned char *map, size_t size)
+{
+  struct ConfigCacheRecord r;
+  const unsigned char *payload;
+  size_t pos = CFGCACHE_HEADER_LEN;
+  bool first = true;
+  uint16_t version, bom;
+
+  if (size < CFGCACHE_HEADER_LEN || memcmp (map, CFGCACHE_MAGIC, 8))
+    return false;
+  memcpy (&version, map + 8, sizeof version);
+  memcpy (&bom, map + 10, sizeof bom);
+  if (version != CFGCACHE_VERSION || bom != CFGCACHE_BOM)
+    return false;
+
+  while (config_cache_next (map, size, &pos, &r, &payload))
+    {
+      size_t fixed = 0;
+      switch (r.type)
+        {
+        case cfgcache_source:
+          fixed = CFGCACHE_SOURCE_LEN;
+          break;
+        case cfgcache_keycode:
+          fixed = CFGCACHE_KEYCODE_LEN + r.count * sizeof (uint16_t);
+          break;
+        case cfgcache_option:
+          {
+            /* The name and the value are both strings */
+            const unsigned char *nul = memchr (payload, 0, r.length);
+            if (!nul || nul + 1 == payload + r.length)
+              return false;
+            break;
+          }
+        case cfgcache_action:
+          if (!r.length)
+            continue;
+          break;
+        case cfgcache_end:
+          return pos == size;
+        }
+      /* Every payload ends in a string */
+      if (r.length <= fixed || payload[r.length - 1])
+        return false;
+      if (r.type == cfgcache_source)
+        {
+          struct stat st;
+          int64_t times[2];
+          uint64_t inode;
+          const char *file = (const char *) payload + fixed;
+          memcpy (times, payload, sizeof times);
+          memcpy (&inode, payload + sizeof times, sizeof inode);
+          if (first && strcmp (file, opts->config_file))
+            return false;
+          first = false;
+          if (stat (file, &st)
+              || st.st_size != r.value
+              || st.st_mtim.tv_sec != times[0]
+              || st.st_mtim.tv_nsec != times[1]
+              || st.st_ino != inode)
+            {
+              errno = 0;
+              return false;
+            }
+        }
+    }
+  return false;
+}
+
+/* Replay a fresh cache */
+static void
+config_cache_replay (ServerOpts *opts, Config *cfg,
+                     const unsigned char *map, size_t size)
+{
+  struct ConfigCacheRecord r;
+  const unsigned char *payload;
+  size_t pos = CFGCACHE_HEADER_LEN;
+  Keymap *km = NULL;
+  const char *key = NULL;
+  Action *first = NULL, **tail = NULL;
+  int actions = 0;
+
+  while (config_cache_next (map, size, &pos, &r, &payload))
+    {
+      const char *s = (const char *) payload;
+      if (actions && r.type != cfgcache_action)
+        fatal (0, "Config cache '%s' is missing actions for '%s'",
+               opts->cache_file, key);
+      switch (r.type)
+        {
+        case cfgcache_source:
+          config_add_source (cfg, s + CFGCACHE_SOURCE_LEN);
+          break;
+        case cfgcache_option:
+          {
+            Token value;
+            value.text = s + strlen (s) + 1;
+            value.len = strlen (value.text);
+            config_option (opts, cfg, NULL, s, &value);
+            break;
+          }
+        case cfgcache_keycode:
+          {
+            IRPacket *k = calloc (1, sizeof *k);
+            IRCode code;
+            uint32_t ac[2];
+            memcpy (ac, payload, sizeof ac);
+            code.protocol = r.value;
+            code.address = ac[0];
+            code.command = ac[1];
+            k->widths = (uint16_t *) (payload + CFGCACHE_KEYCODE_LEN);
+            k->n_pulses = k->n_pulses_allocated = r.count;
+            k->early_id = -1;
+            irdict_insert_decoded (cfg->buttondict,
+                                   s + CFGCACHE_KEYCODE_LEN
+                                   + r.count * sizeof (uint16_t), k,
+                                   code.protocol == irproto_raw
+                                   ? NULL : &code);
+            break;
+          }
+        case cfgcache_keymap:
+          km = new_keymap (s);
+          config_add_keymap (cfg, km);
+          break;
+        case cfgcache_inherit:
+        case cfgcache_key:
+          if (!km)
+            fatal (0, "Config cache '%s' has keys outside a keymap",
+                   opts->cache_file);
+          if (r.type == cfgcache_inherit)
+            keymap_inherit (km, s);
+          else if (!(actions = r.count))
+            keymap_add_action (km, s, NULL);
+          key = s;
+          first = NULL;
+          tail = &first;
+          break;
+        case cfgcache_action:
+          if (!actions)
+            fatal (0, "Config cache '%s' has an action outside a key",
+                   opts->cache_file);
+          *tail = new_action (r.count, r.length ? s : NULL);
+          (*tail)->repeat = r.value;
+          tail = &(*tail)->next;
+          if (!--actions)
+            keymap_add_action (km, key, first);
+          break;
+        }
+    }
+}
+
+/* Replay the cache if it's fresh */
+static bool
+config_cache_load (ServerOpts *opts, Config *cfg)
+{
+  struct stat st;
+  unsigned char *map;
+  int fd = open (opts->cache_file, O_RDONLY);
+  if (fd < 0)
+    {
+      errno = 0;
+      return false;
+    }
+  if (fstat (fd, &st) || !st.st_size)
+    {
+      close (fd);
+      errno = 0;
+      return false;
+    }
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    fatal (0, "Can't map config cache '%s'", opts->cache_file);
+  if (!config_cache_fresh (opts, map, st.st_size))
+    {
+      if (opts->verbose)
+        fprintf (stdout, "Config cache '%s' is out of date\n",
+                 opts->cache_file);
+      munmap (map, st.st_size);
+      return false;
+    }
+  if (opts->verbose)
+    fprintf (stdout, "Reading config cache '%s'\n", opts->cache_file);
+  cfg->cache_map = map;
+  cfg->cache_size = st.st_size;
+  config_cache_replay (opts, cfg, map, st.st_size);
+  return true;
+}
+
+/* Read the config and button dictionary, from the cache if possible */
+void
+load_config (ServerOpts *opts, Config *cfg)
+{
+  if (!opts->config_file)
+    return;
+  if (opts->cache_file)
+    {
+      if (config_cache_load (opts, cfg))
+        return;
+      config_cache_create (opts);
+    }
+  read_config (opts, cfg, opts->config_file);
+  if (opts->buttondict_fname)
+    read_buttondict (opts, cfg, opts->buttondict_fname);
+  if (opts->cache)
+    config_cache_finish (opts);
+}
+
+/* ------------------------------------------------------------
+ * VLC remote connection
+ */
+bool
+vlc_command (IRServerInfo *si, const char *command)
+{
+  Connection *n = si->vlc;
+  if (n)
+    {
+      connection_write (n, command, strlen (command));
+      connection_write (n, "\n", 1);
+      if (si->verbose)
+        fprintf (stdout, "Sent command '%s' to VLC\n", command);
+      return true;
+    }
+  else
+    {
+      return false;
+    }
+}
+
+void
+can_read_vlc (Connection *n, void *h)
+{
+  char buffer[BUFSIZ];
+  int fd = connection_fd (n);
+  int count = read (fd, buffer, BUFSIZ);
+  IRServerInfo *si = (IRServerInfo *)h;
+
+  if (count == 0)
+    {
+      if (si->vlc != n)
+        fatal (0, "can_read_vlc(n): n != n->server->vlc");
+      si->vlc = NULL;
+      close (fd);
+      connection_remove (n);
+    }
+  fprintf (stdout, "VLC response:\n");
+  fflush (stdout);
+  write (fileno (stdout), buffer, count);
+  fprintf (stdout, "\n");
+}
+
+Connection *
+open_vlc (IRServerInfo *si, char *host, int port)
+{
+  Connection *vlc;
+  int fd;
+  if (si->verbose)
+    fprintf (stdout, "Opening VLC port %s:%d\n", host, port);
+  vlc = connection_port (si->server, host, port, si);
+  if (!vlc)
+    return NULL;
+  fd = connection_fd (vlc);
+  if (fd == -1)
+    return NULL;
+
+  /* Set it non-blocking */
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  connection_set_write_limit (vlc, ir_write_limit, ir_write_overflow);
+  connection_set_can_read(vlc, can_read_vlc);
+  si->vlc = vlc;
+  return vlc;
+}
+
+
+/* ------------------------------------------------------------
+ * Myth remote connection
+ */
+
+bool
+mythremote_command (IRServerInfo *si, const char *command)
+{
+  Connection *n = si->mythremote;
+  if (n)
+    {
+      connection_write (n, command, strlen (command));
+      connection_write (n, "\n", 1);
+      if (si->verbose)
+        fprintf (stdout, "Sent command '%s' to MythTV\n", command);
+      return true;
+    }
+  else
+    {
+      return false;
+    }
+}
+
+void
+can_read_mythremote (Connection * n, void *h)
+{
+  char buffer[BUFSIZ];
+  int fd = connection_fd (n);
+  int count = read (fd, buffer, BUFSIZ);
+  IRServerInfo *si = (IRServerInfo *)h;
+
+  if (count == 0)
+    {
+      if (si->mythremote != n)
+        fatal (0, "can_read_mythremote(n): n != n->server->mythremote");
+      si->mythremote = NULL;
+      close (fd);
+      connection_remove (n);
+    }
+  fprintf (stdout, "mythtv response:\n");
+  fflush (stdout);
+  write (fileno (stdout), buffer, count);
+  fprintf (stdout, "\n");
+}
+
+Connection *
+open_mythremote (IRServerInfo *si, char *host, int port)
+{
+  Connection *mythremote;
+  int fd;
+  if (si->verbose)
+    fprintf (stdout, "Opening MythRemote port %s:%d\n", host, port);
+  mythremote = connection_port (si->server, host, port, si);
+  if (!mythremote)
+    return NULL;
+  fd = connection_fd (mythremote);
+  if (fd == -1)
+    return NULL;
+
+  /* Set it non-blocking */
+  fcntl (fd, F_SETFL,
+         fcntl (fd, F_GETFL) | O_NONBLOCK);
+  connection_set_write_limit (mythremote, ir_write_limit, ir_write_overflow);
+  connection_set_can_read (mythremote, can_read_mythremote);
+  si->mythremote = mythremote;
+  return mythremote;
+}
+
+
+/* ------------------------------------------------------------
+ * IR connection
+ */
+
+/* Send the frame at the head of the transmit queue, unless one is
+   already in flight */
+void
+transmit_start (IRServerInfo *si)
+{
+  IRTransmit *t = si->tx_first;
+  if (si->tx_in_flight || !t)
+    return;
+  if (!si->irdev)
+    {
+      /* Nowhere to send it */
+      si->tx_first = t->next;
+      if (!si->tx_first)
+        si->tx_last = NULL;
+      config_unref (t->config);
+      free (t);
+      transmit_start (si);
+      return;
+    }
+  connection_write (si->irdev, (const char *) t->frame->data, t->frame->len);
+  pipeline_event (si, rx_expect_ack);
+  si->tx_in_flight = true;
+  gettimeofday (&si->tx_time, NULL);
+  connection_set_deadline (si->irdev, ir_packet_timeout);
+}
+
+/* The frame in flight has been answered (or given up on) */
+void
+transmit_done (IRServerInfo *si)
+{
+  IRTransmit *t = si->tx_first;
+  if (!si->tx_in_flight || !t)
+    return;
+  si->tx_first = t->next;
+  if (!si->tx_first)
+    si->tx_last = NULL;
+  si->tx_in_flight = false;
+  config_unref (t->config);
+  free (t);
+  transmit_start (si);
+}
+
+/* Queue BUTTON for transmission, sent REPEATS times back to back */
+IRPacket *
+transmit_button (IRServerInfo *si, int button, int repeats)
+{
+  IRSymbol *sym;
+  sym = irdict_id_symbol (si->config->buttondict, button);
+  if (sym)
+    {
+      int i;
+      IRTransmit *t;
+
+      if (!si->irdev)
+        {
+          if (si->verbose)
+            fprintf (stdout, "(No IR connection to transmit on)\n");
+          return sym->packet;
+        }
+
+      t = malloc (sizeof *t);
+      t->next = NULL;
+      t->frame = irsymbol_frame (sym, repeats);
+      t->config = config_ref (si->config);
+
+      if (si->verbose)
+        {
+          fprintf (stdout, "Transmitting: ");
+          for (i = 0; i < t->frame->len; i++)
+            fprintf (stdout, "%d ", t->frame->data[i]);
+          fprintf (stdout, "\n");
+        }
+
+      if (si->tx_last)
+        si->tx_last->next = t;
+      else
+        si->tx_first = t;
+      si->tx_last = t;
+      transmit_start (si);
+      return sym->packet;
+    }
+  return NULL;
+}
+
+/* Receive a button-press packet */
+void
+receive_button (IRServerInfo *si, Connection * n, int button)
+{
+  bool repeated = false;
+
+  /* Some remotes use a 'repeat last keypress' symbol. Detect this and
+   * repeat the last keypress we emitted. 
+   */
+  if (button == si->config->repeat_id)
+    {
+      if (si->verbose)
+        fprintf (stdout, "REPEAT symbol from remote -> '%s'\n",
+                 irdict_name (si->config->buttondict, si->last_button));
+      button = si->last_button;
+      if (button < 0)
+        /* No previous keypress. Weird, but possible if packet was
+         *  lost. Ignore.
+         */
+        return;
+    }
+  if (button == si->last_button)
+    {
+      /* Possibly repeated button press */
+      struct timeval tv;
+      gettimeofday (&tv, NULL);
+      if (tv.tv_sec > si->next_repeat_time.tv_sec
+          || (tv.tv_sec == si->next_repeat_time.tv_sec
+              && tv.tv_usec >= si->next_repeat_time.tv_usec))
+        {
+          /* Repeat keypress */
+          if (si->verbose)
+            fprintf (stdout, "Repeated keypress ok\n");
+            repeated = true;
+        }
+      else
+        {
+          /* Repeated keypress, but within repeat 
+             timeout. Don't process button, and don't reset repeat
+             time. */
+          if (si->verbose)
+            fprintf (stdout, "Dropping too-soon keypress\n");
+          return;
+        }
+    }
+  
+  /* First press of a new/different button, or after repeat time
+     has elapsed.  */
+  handle_button (si, button);
+  if (repeated)
+    {
+      /* Accelerate repeat time */
+      ir_repeat_delay -= (ir_debounce_time / 16);
+      if (ir_repeat_delay < 0)
+        ir_repeat_delay = 0;
+      if (si->verbose)
+        fprintf (stdout, "repeated button, ir_repeat_delay=%d\n",
+                 ir_repeat_delay);
+    }
+  else
+    {
+      /* Set initial repeat time */
+      ir_repeat_delay = ir_debounce_time;
+      if (si->verbose)
+        fprintf (stdout, "pressed button, ir_repeat_delay=%d\n",
+                 ir_repeat_delay);
+  }
+
+  /* Set earliest repeat time to ir_repeat_delay usecs in the
+     future. */
+  gettimeofday (&si->last_button_time, NULL);
+  si->next_repeat_time = si->last_button_time;
+  si->next_repeat_time.tv_usec += ir_repeat_delay;
+  if (si->next_repeat_time.tv_usec >= 1000000)
+    {
+      si->next_repeat_time.tv_sec +=
+        si->next_repeat_time.tv_usec / 1000000;
+      si->next_repeat_time.tv_usec =
+        si->next_repeat_time.tv_usec % 1000000;
+    }
+  si->last_button = button;
+}
+
+/* ------------------------------------------------------------
+ * Receive pipeline
+ * The event loop only reads the IR device into rx_ring. A decode
+ * thread turns the bytes into packets and button names, and an action
+ * thread runs the keymap for each name, so a slow action never holds
+ * up reading the device.
+ *
+ * Each ring has one consumer. The producers of rx_ring (the event
+ * loop, and the action thread when it transmits) are serialised by
+ * si->lock, which the event loop holds except while it waits for I/O
+ * and which the action thread takes to run actions. When a stage
+ * falls behind, the one feeding it waits: the decode thread for room
+ * in action_ring, the event loop by leaving bytes in the device.
+ */
+
+static void
+ring_init (Ring * r, unsigned n_slots, size_t slot_size)
+{
+  r->n_slots = n_slots;
+  r->slot_size = slot_size;
+  r->slots = malloc (n_slots * slot_size);
+  atomic_init (&r->head, 0);
+  atomic_init (&r->tail, 0);
+  atomic_init (&r->sleepers, 0);
+  pthread_mutex_init (&r->lock, NULL);
+  pthread_cond_init (&r->cond, NULL);
+}
+
+static unsigned
+ring_used (Ring * r)
+{
+  return atomic_load (&r->head) - atomic_load (&r->tail);
+}
+
+/* The slot to fill next, or NULL if the ring is full */
+static void *
+ring_slot_in (Ring * r)
+{
+  if (ring_used (r) == r->n_slots)
+    return NULL;
+  return r->slots + (atomic_load (&r->head) & (r->n_slots - 1))
+    * r->slot_size;
+}
+
+/* The slot to drain next, or NULL if the ring is empty */
+static void *
+ring_slot_out (Ring * r)
+{
+  if (!ring_used (r))
+    return NULL;
+  return r->slots + (atomic_load (&r->tail) & (r->n_slots - 1))
+    * r->slot_size;
+}
+
+static void
+ring_wake (Ring * r)
+{
+  if (atomic_load (&r->sleepers))
+    {
+      pthread_mutex_lock (&r->lock);
+      pthread_cond_broadcast (&r->cond);
+      pthread_mutex_unlock (&r->lock);
+    }
+}
+
+static void
+ring_push (Ring * r)
+{
+  atomic_fetch_add (&r->head, 1);
+  ring_wake (r);
+}
+
+static void
+ring_pop (Ring * r)
+{
+  atomic_fetch_add (&r->tail, 1);
+  ring_wake (r);
+}
+
+/* Sleep until the ring has room (FOR_ROOM) or has something in it */
+static void
+ring_wait (Ring * r, bool for_room)
+{
+  pthread_mutex_lock (&r->lock);
+  atomic_fetch_add (&r->sleepers, 1);
+  while (for_room ? ring_used (r) == r->n_slots : !ring_used (r))
+    pthread_cond_wait (&r->cond, &r->lock);
+  atomic_fetch_sub (&r->sleepers, 1);
+  pthread_mutex_unlock (&r->lock);
+}
+
+/* Nudge the event loop out of its wait */
+static void
+pipeline_wake (IRServerInfo *si)
+{
+  char c = 0;
+  if (write (si->wake_fd[1], &c, 1) < 0)
+    errno = 0;                  /* already full of nudges */
+}
+
+/* Hand a control event to the decode thread, behind the bytes already
+   read. Called with si->lock held. */
+static void
+pipeline_event (IRServerInfo *si, RxType type)
+{
+  RxSlot *r = ring_slot_in (&si->rx_ring);
+  if (!r)
+    {
+      si->rx_dropped++;
+      warning ("Receive ring full, dropping event %d\n", type);
+      return;
+    }
+  r->type = type;
+  r->n_bytes = 0;
+  r->config = NULL;
+  ring_push (&si->rx_ring);
+}
+
+/* Send a newly read config down the pipeline. Each thread switches
+   to it when it gets there, so no packet is decoded with one config
+   and acted on with another. Called with si->lock held. */
+static bool
+pipeline_reload (IRServerInfo *si, Config *cfg)
+{
+  RxSlot *r = ring_slot_in (&si->rx_ring);
+  if (!r)
+    {
+      si->rx_dropped++;
+      warning ("Receive ring full, dropping config reload\n");
+      return false;
+    }
+  r->type = rx_reload;
+  r->n_bytes = 0;
+  r->config = cfg;
+  ring_push (&si->rx_ring);
+  return true;
+}
+
+/* Queue an entry for the action thread */
+static void
+pipeline_action (IRServerInfo *si, int button, Config *cfg)
+{
+  ActionSlot *slot;
+  while (!(slot = ring_slot_in (&si->action_ring)))
+    {
+      atomic_fetch_add (&si->action_stalls, 1);
+      ring_wait (&si->action_ring, true);
+    }
+  slot->button = button;
+  slot->config = cfg;
+  ring_push (&si->action_ring);
+}
+
+/* Queue a button name id for the action thread. -1 ends the current
+   run of repeats. */
+static void
+pipeline_button (IRServerInfo *si, int button)
+{
+  pipeline_action (si, button, NULL);
+}
+
+/* Switch the decode thread to CFG, taking a reference to it */
+static void
+decode_set_config (IRServerInfo *si, Config *cfg)
+{
+  Config *old = si->rx_config;
+  si->rx_config = config_ref (cfg);
+  irtoy_jitter = cfg->tuning.jitter;
+  irtoy_grid = cfg->tuning.grid;
+  irstate_set_gap (si->ir, cfg->tuning.gap);
+  if (cfg->packet_pulses)
+    irstate_set_pool_pulses (si->ir, cfg->packet_pulses);
+  irstate_set_early_dict (si->ir, cfg->early_dispatch
+                          ? cfg->buttondict : NULL);
+  config_unref (old);
+}
+
+/* Look up and dispatch a packet received from the IR interface. On
+   the decode thread. */
+static void
+receive_ir_packet (IRServerInfo *si, IRPacket * k, bool timeout)
+{
+  int id;
+  const char *name;
+  if (si->verbose || timeout)
+    {
+      fprintf (stdout, "Received IR packet%s: ", timeout ? " on timeout" : "");
+      irpacket_printf (stdout, k);
+      fprintf (stdout, "\n");
+      irpacket_render (stdout, k);
+      fprintf (stdout, "\n");
+    }
+  id = irdict_lookup_packet (si->rx_config->buttondict, k);
+  name = irdict_name (si->rx_config->buttondict, id);
+  if (si->out_file)
+    {
+      struct timeval tv;
+      gettimeofday (&tv, NULL);
+      pthread_mutex_lock (&si->out_lock);
+      if (name)
+        fprintf (si->out_file, "key \"%s\" ", name);
+      else
+        fprintf (si->out_file, "key %s ",
+                 si->unknown_key? si->unknown_key : "UNKNOWN");
+      fprintf (si->out_file, "@%llu ",
+               (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec);
+      irpacket_printf (si->out_file, k);
+      fprintf (si->out_file, timeout ? " # on timeout\n" : "\n");
+      fflush (si->out_file);
+      pthread_mutex_unlock (&si->out_lock);
+    }
+  if (k->early_taken)
+    {
+      if (timeout)
+        fprintf (stdout, "Button name '%s' (dispatched early)\n",
+                 irdict_name (si->rx_config->buttondict, k->early_id));
+    }
+  else if (name)
+    {
+      if (timeout)
+        fprintf (stdout, "Button name '%s'\n", name);
+      pipeline_button (si, id);
+    }
+  else if (si->verbose || timeout)
+    fprintf (stdout, "Unknown packet\n");
+  irstate_release_packet (si->ir, k);
+}
+
+/* Copy the packet pool and lookup counters to si->decode_stats for
+   "?stats". On the decode thread, which alone updates them. */
+static void
+decode_publish_stats (IRServerInfo *si)
+{
+  DecodeStats *ds = &si->decode_stats;
+  IRState *ir = si->ir;
+  IRDict *d = si->rx_config->buttondict;
+  atomic_store (&ds->pool_size, ir->pool_size);
+  atomic_store (&ds->pool_in_use, ir->pool_in_use);
+  atomic_store (&ds->pool_high_water, ir->pool_high_water);
+  atomic_store (&ds->pool_pulses, ir->pool_pulses);
+  atomic_store (&ds->pool_spills, ir->pool_spills);
+  atomic_store (&ds->code_hits, d->code_hits);
+  atomic_store (&ds->grid_hits, d->grid_hits);
+  atomic_store (&ds->slow_lookups, d->slow_lookups);
+  atomic_store (&ds->slow_hits, d->slow_hits);
+}
+
+static void *
+decode_thread_main (void *p)
+{
+  IRServerInfo *si = p;
+  IRPacket *packets[IR_READ_SIZE / 2 + 1];
+  int n_packets, i, id;
+
+  decode_publish_stats (si);
+  for (;;)
+    {
+      RxSlot *r;
+      while (!(r = ring_slot_out (&si->rx_ring)))
+        ring_wait (&si->rx_ring, false);
+      switch (r->type)
+        {
+        case rx_bytes:
+          n_packets = irstate_rxbytes (si->ir, r->n_bytes, r->bytes, packets);
+          for (i = 0; i < n_packets; i++)
+            receive_ir_packet (si, packets[i], false);
+          /* The packet still arriving may already be unambiguous */
+          id = irstate_take_early (si->ir);
+          if (id >= 0)
+            {
+              if (si->verbose)
+                fprintf (stdout, "Early match '%s'\n",
+                         irdict_name (si->rx_config->buttondict, id));
+              atomic_fetch_add (&si->early_dispatches, 1);
+              pipeline_button (si, id);
+            }
+          i = irstate_collect_acks (si->ir);
+          if (i)
+            {
+              if (si->verbose)
+                fprintf (stdout, "Returned %d (%c) %d %d\n",
+                         si->ir->ack[0], si->ir->ack[0],
+                         si->ir->ack[1], si->ir->ack[2]);
+              atomic_fetch_add (&si->acks_pending, i);
+              pipeline_wake (si);
+            }
+          break;
+        case rx_timeout:
+          {
+            IRPacket *k = irstate_timeout (si->ir);
+            if (k)
+              receive_ir_packet (si, k, true);
+            /* Reset last button and repeat timer */
+            pipeline_button (si, -1);
+            break;
+          }
+        case rx_expect_ack:
+          {
+            /* With early dispatch the packet may not have ended */
+            IRPacket *k = irstate_expect_ack (si->ir);
+            if (k)
+              receive_ir_packet (si, k, false);
+            break;
+          }
+        case rx_cancel_ack:
+          irstate_cancel_ack (si->ir);
+          break;
+        case rx_reload:
+          /* The slot's reference goes on to the action thread */
+          decode_set_config (si, r->config);
+          pipeline_action (si, -1, r->config);
+          break;
+        }
+      decode_publish_stats (si);
+      ring_pop (&si->rx_ring);
+      if (atomic_load (&si->rx_stalled))
+        pipeline_wake (si);
+    }
+  return NULL;
+}
+
+/* Take the timing the event loop and action thread use from T. Called
+   with si->lock held, or before the threads start. */
+static void
+action_set_tuning (const ConfigTuning *t)
+{
+  irtoy_gap = t->gap;
+  ir_packet_timeout = t->packet_timeout;
+  ir_debounce_time = t->debounce_time;
+  ir_transmit_timeout = t->transmit_timeout;
+  ir_write_limit = t->write_limit;
+  ir_write_overflow = t->write_overflow;
+}
+
+/* Switch the action thread to CFG, whose reference it takes, staying
+   in the keymap of the same name if there is one. Called with si->lock
+   held. */
+static void
+action_set_config (IRServerInfo *si, Config *cfg)
+{
+  Keymap *km = NULL;
+  if (si->current_keymap)
+    km = config_keymap (cfg, si->current_keymap->name);
+  config_unref (si->config);
+  si->config = cfg;
+  action_set_tuning (&cfg->tuning);
+  si->current_keymap = km ? km : cfg->last_keymap;
+  if (si->verbose)
+    fprintf (stdout, "Config reloaded, keymap '%s'\n",
+             si->current_keymap ? si->current_keymap->name : "(none)");
+}
+
+static void *
+action_thread_main (void *p)
+{
+  IRServerInfo *si = p;
+  for (;;)
+    {
+      ActionSlot *slot;
+      int button;
+      Config *cfg;
+      while (!(slot = ring_slot_out (&si->action_ring)))
+        ring_wait (&si->action_ring, false);
+      button = slot->button;
+      cfg = slot->config;
+      ring_pop (&si->action_ring);
+
+      pthread_mutex_lock (&si->lock);
+      if (cfg)
+        action_set_config (si, cfg);
+      if (button >= 0)
+        receive_button (si, NULL, button);
+      else
+        {
+          si->last_button = -1;
+          ir_repeat_delay = 0;
+        }
+      pthread_mutex_unlock (&si->lock);
+      /* The event loop may have output or a deadline to pick up */
+      pipeline_wake (si);
+    }
+  return NULL;
+}
+
+/* The IR device has gone: close it, and drop anything still waiting
+   to be transmitted */
+static void
+close_ir (IRServerInfo *si, Connection * n)
+{
+  if (si->verbose)
+    fprintf (stdout, "Closed IR connection\n");
+  close (connection_fd (n));
+  if (si->irdev != n)
+    fatal (0, "close_ir(n): n != si->irdev");
+  si->irdev = NULL;
+  si->tx_in_flight = false;
+  transmit_start (si);
+  connection_remove (n);
+}
+
+void
+can_read_ir (Connection * n, void *h)
+{
+  IRServerInfo *si = (IRServerInfo *)h;
+  int fd = connection_fd (n);
+  int count;
+
+  /* Drain everything the device has for us, a slot at a time */
+  for (;;)
+    {
+      RxSlot *r = NULL;
+      if (ring_used (&si->rx_ring) <= RX_SLOTS - RX_RESERVE)
+        r = ring_slot_in (&si->rx_ring);
+      if (!r)
+        {
+          /* Decoding is behind. Leave the rest in the device until
+             the decode thread wakes us. */
+          atomic_store (&si->rx_stalled, true);
+          if (ring_used (&si->rx_ring) <= RX_SLOTS - RX_RESERVE)
+            {
+              /* It just caught up */
+              atomic_store (&si->rx_stalled, false);
+              continue;
+            }
+          si->rx_stalls++;
+          connection_set_can_read (n, NULL);
+          return;
+        }
+      count = read (fd, r->bytes, sizeof r->bytes);
+      if (count <= 0)
+        break;
+      /* A packet still under construction ends if nothing more
+         arrives within ir_packet_timeout. */
+      connection_set_deadline (n, ir_packet_timeout);
+      r->type = rx_bytes;
+      r->n_bytes = count;
+      ring_push (&si->rx_ring);
+      if (count < sizeof r->bytes)
+        break;
+    }
+  if (count == 0)
+    close_ir (si, n);
+}
+
+/* The IR device won't take a transmit frame */
+void
+write_error_ir (Connection * n, void *h)
+{
+  close_ir ((IRServerInfo *)h, n);
+}
 
-bool
-mythremote_command (IRServerInfo *si, const char *command)
+/* The decode or action thread has something for the event loop */
+void
+can_read_wake (Connection * n, void *h)
 {
-  Connection *n = si->mythremote;
-  if (n)
+  IRServerInfo *si = (IRServerInfo *)h;
+  char buffer[64];
+  int i;
+
+  while (read (connection_fd (n), buffer, sizeof buffer) > 0)
+    ;
+  errno = 0;
+  for (i = atomic_exchange (&si->acks_pending, 0); i > 0; i--)
+    transmit_done (si);
+  if (reload_requested)
     {
-      connection_write (n, command, strlen (command));
-      connection_write (n, "\n", 1);
-      if (si->verbose)
-        fprintf (stdout, "Sent command '%s' to MythTV\n", command);
-      return true;
+      reload_requested = 0;
+      config_reload (si);
     }
-  else
+  if (atomic_load (&si->rx_stalled) && si->irdev
+      && ring_used (&si->rx_ring) <= RX_SLOTS - RX_RESERVE)
     {
-      return false;
+      atomic_store (&si->rx_stalled, false);
+      connection_set_can_read (si->irdev, can_read_ir);
+      can_read_ir (si->irdev, si);
     }
 }
 
 void
-can_read_mythremote (Connection * n, void *h)
+timeout_ir (Connection * n, void *h)
 {
-  char buffer[BUFSIZ];
-  int fd = connection_fd (n);
-  int count = read (fd, buffer, BUFSIZ);
   IRServerInfo *si = (IRServerInfo *)h;
 
-  if (count == 0)
+  pipeline_event (si, rx_timeout);
+
+  /* Keep waiting for the response to a transmitted frame, up to a
+     point. */
+  if (si->tx_in_flight)
     {
-      if (si->mythremote != n)
-        fatal (0, "can_read_mythremote(n): n != n->server->mythremote");
-      si->mythremote = NULL;
-      close (fd);
-      connection_remove (n);
+      struct timeval now;
+      long elapsed;
+      gettimeofday (&now, NULL);
+      elapsed = (now.tv_sec - si->tx_time.tv_sec) * 1000000
+        + (now.tv_usec - si->tx_time.tv_usec);
+      if (elapsed >= ir_transmit_timeout)
+        {
+          warning ("No response to transmitted frame\n");
+          pipeline_event (si, rx_cancel_ack);
+          transmit_done (si);
+        }
+      else
+        connection_set_deadline (n, ir_packet_timeout);
     }
-  fprintf (stdout, "mythtv response:\n");
-  fflush (stdout);
-  write (fileno (stdout), buffer, count);
-  fprintf (stdout, "\n");
+
 }
 
-Connection *
-open_mythremote (IRServerInfo *si, char *host, int port)
+/* Start the decode and action threads. The calling thread carries on
+   as the event loop, holding si->lock. */
+void
+pipeline_start (IRServerInfo *si)
 {
-  Connection *mythremote;
-  int fd;
-  if (si->verbose)
-    fprintf (stdout, "Opening MythRemote port %s:%d\n", host, port);
-  mythremote = connection_port (si->server, host, port, si);
-  if (!mythremote)
-    return NULL;
-  fd = connection_fd (mythremote);
-  if (fd == -1)
-    return NULL;
+  pthread_t tid;
+  Connection *wake;
+  int i;
 
-  /* Set it non-blocking */
-  fcntl (fd, F_SETFL,
-         fcntl (fd, F_GETFL) | O_NONBLOCK);
-  connection_set_can_read (mythremote, can_read_mythremote);
-  si->mythremote = mythremote;
-  return mythremote;
+  ring_init (&si->rx_ring, RX_SLOTS, sizeof (RxSlot));
+  ring_init (&si->action_ring, ACTION_SLOTS, sizeof (ActionSlot));
+  if (pipe (si->wake_fd) < 0)
+    fatal (0, "Couldn't create pipeline wake pipe");
+  for (i = 0; i < 2; i++)
+    fcntl (si->wake_fd[i], F_SETFL,
+           fcntl (si->wake_fd[i], F_GETFL) | O_NONBLOCK);
+  wake = new_connection (si->server, si->wake_fd[0], "pipeline", si);
+  connection_set_can_read (wake, can_read_wake);
+
+  pthread_mutex_lock (&si->lock);
+  server_set_lock (si->server, &si->lock);
+  if (pthread_create (&tid, NULL, decode_thread_main, si)
+      || pthread_create (&tid, NULL, action_thread_main, si))
+    fatal (0, "Couldn't start pipeline threads");
 }
 
-
 /* ------------------------------------------------------------
- * IR connection
+ * Config reload
+ * On SIGHUP, "?reload" on the command port, or (on Linux) a change to
+ * any file the config was read from, the event loop reads the config
+ * again and sends it down the pipeline. Tuning options (jitter, gap,
+ * timeouts and so on) take effect as each thread switches to the new
+ * config; options that open a device or connection wait for a
+ * restart. The old config is freed once both threads have switched
+ * and the transmit queue has drained past it.
  */
 
-IRPacket *
-transmit_button (IRServerInfo *si, const char *button)
-{
-  IRPacket *k;
-  k = irdict_lookup_name (si->buttondict, button);
-  if (k)
-    {
-      int i;
-      char *buffer, *b;
-      int len = 3 + 2 * k->n_pulses;
-      buffer = malloc (len);
-      b = buffer;
-
-      *b++ = 3;                 /* start transmission */
-      for (i = 0; i < k->n_pulses; i++)
-        {
-          *b++ = (k->pulses[i].width) >> 8;     /* high byte */
-          *b++ = (k->pulses[i].width) & 0xff;   /* low byte */
-        }
-      *b++ = 0xff;
-      *b++ = 0xff;
+#define CONFIG_SETTLE_TIME 200000  /* usecs after a change to reload */
 
-      if (si->verbose)
-        {
-          fprintf (stdout, "Transmitting: ");
-          for (i = 0; i < len; i++)
-            fprintf (stdout, "%d ", buffer[i]);
-          fprintf (stdout, "\n");
-        }
+static int reload_wake_fd = -1;
 
-      if (si->irdev)
-        {
-          char response[3];
-	  int fd = connection_fd (si->irdev);
-          connection_write (si->irdev, buffer, len);
-
-          /* Temporarily set the connection blocking. Blugh. */
-          fcntl (fd, F_SETFL,
-                 fcntl (fd, F_GETFL) & ~O_NONBLOCK);
-
-          /* Read the return message */
-          read (fd, response, 3);
-          fprintf (stdout, "Returned %d (%c) %d %d\n",
-                   response[0], response[0], response[1], response[2]);
-
-          /* Set blocking again */
-          fcntl (fd, F_SETFL,
-                 fcntl (fd, F_GETFL) | O_NONBLOCK);
-        }
-      else if (si->verbose)
-        {
-          fprintf (stdout, "(No IR connection to transmit on)\n");
-        }
-      free (buffer);
-      return k;
-    }
-  return NULL;
+static void
+sighup_handler (int sig)
+{
+  char c = 0;
+  reload_requested = 1;
+  if (write (reload_wake_fd, &c, 1) < 0)
+    ;                           /* already full of nudges */
 }
 
-/* Receive a button-press packet */
-void
-receive_button (IRServerInfo *si, Connection * n, const char *name)
+#ifdef USE_INOTIFY
+/* Watch the directories of the files CFG was read from: editors often
+   replace a file rather than write to it */
+static void
+config_watch (IRServerInfo *si, Config *cfg)
 {
-  bool repeated = false;
-
-  /* Some remotes use a 'repeat last keypress' symbol. Detect this and
-   * repeat the last keypress we emitted. 
-   */
-  if (!strcmp(name, "REPEAT"))
-    {
-      if (si->verbose)
-        fprintf (stdout, "REPEAT symbol from remote -> '%s'\n",
-                 si->last_button);
-      name = si->last_button;
-      if (!name)
-        /* No previous keypress. Weird, but possible if packet was
-         *  lost. Ignore.
-         */
-        return;
-    }
-  if (   si->last_button != NULL
-      && (   name == si->last_button
-          || !strcmp(name, si->last_button)))
+  int i;
+  if (si->watch_fd < 0)
+    return;
+  for (i = 0; i < si->n_watch_wds; i++)
+    inotify_rm_watch (si->watch_fd, si->watch_wds[i]);
+  si->watch_wds = realloc (si->watch_wds,
+                           (cfg->n_sources + 1) * sizeof *si->watch_wds);
+  si->n_watch_wds = cfg->n_sources;
+  config_unref (si->watch_config);
+  si->watch_config = config_ref (cfg);
+  for (i = 0; i < cfg->n_sources; i++)
     {
-      /* Possibly repeated button press */
-      struct timeval tv;
-      gettimeofday (&tv, NULL);
-      if (tv.tv_sec > si->next_repeat_time.tv_sec
-          || (tv.tv_sec == si->next_repeat_time.tv_sec
-              && tv.tv_usec >= si->next_repeat_time.tv_usec))
-        {
-          /* Repeat keypress */
-          if (si->verbose)
-            fprintf (stdout, "Repeated keypress ok\n");
-            repeated = true;
-        }
+      char *dir = strdup (cfg->sources[i]);
+      char *slash = strrchr (dir, '/');
+      if (!slash)
+        strcpy (dir, ".");
       else
-        {
-          /* Repeated keypress, but within repeat 
-             timeout. Don't process button, and don't reset repeat
-             time. */
-          if (si->verbose)
-            fprintf (stdout, "Dropping too-soon keypress\n");
-          return;
-        }
-    }
-  
-  /* First press of a new/different button, or after repeat time
-     has elapsed.  */
-  handle_button (si, name);
-  if (repeated)
-    {
-      /* Accelerate repeat time */
-      ir_repeat_delay -= (ir_debounce_time / 16);
-      if (ir_repeat_delay < 0)
-        ir_repeat_delay = 0;
-      if (si->verbose)
-        fprintf (stdout, "repeated button, ir_repeat_delay=%d\n",
-                 ir_repeat_delay);
-    }
-  else
-    {
-      /* Set initial repeat time */
-      ir_repeat_delay = ir_debounce_time;
-      if (si->verbose)
-        fprintf (stdout, "pressed button, ir_repeat_delay=%d\n",
-                 ir_repeat_delay);
-  }
-
-  /* Set earliest repeat time to ir_repeat_delay usecs in the
-     future. */
-  gettimeofday (&si->last_button_time, NULL);
-  si->next_repeat_time = si->last_button_time;
-  si->next_repeat_time.tv_usec += ir_repeat_delay;
-  if (si->next_repeat_time.tv_usec >= 1000000)
-    {
-      si->next_repeat_time.tv_sec +=
-        si->next_repeat_time.tv_usec / 1000000;
-      si->next_repeat_time.tv_usec =
-        si->next_repeat_time.tv_usec % 1000000;
+        slash[slash == dir] = '\0';
+      si->watch_wds[i] = inotify_add_watch (si->watch_fd, dir,
+                                            IN_CLOSE_WRITE | IN_MOVED_TO
+                                            | IN_CREATE | IN_DELETE);
+      free (dir);
     }
-  si->last_button = name;
+  errno = 0;
 }
 
-void
-can_read_ir (Connection * n, void *h)
+/* Something changed in a watched directory. Reload once it has been
+   quiet for a while, if it was one of the config's files. */
+static void
+can_read_watch (Connection * n, void *h)
 {
-  IRPacket *k;
-  int count;
-  unsigned char c;
   IRServerInfo *si = (IRServerInfo *)h;
-  int fd = connection_fd (n);
-  count = read (fd, &c, 1);
-  if (count != 0)
+  char buffer[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  Config *cfg = si->watch_config;
+  int count, i;
+
+  while ((count = read (si->watch_fd, buffer, sizeof buffer)) > 0)
     {
-      count = irstate_rxbytes (si->ir, 1, &c, &k);
-      if (count)
+      struct inotify_event *ev;
+      char *p;
+      for (p = buffer; p < buffer + count; p += sizeof *ev + ev->len)
         {
-          /* Received a complete packet from the IR interface */
-          const char *name;
-          if (si->verbose)
-            {
-              fprintf (stdout, "Received IR packet: ");
-              irpacket_printf (stdout, k);
-              fprintf (stdout, "\n");
-              irpacket_render (stdout, k);
-              fprintf (stdout, "\n");
-            }
-          name = irdict_lookup_packet (si->buttondict, k);
-          if (si->out_file)
+          ev = (struct inotify_event *) p;
+          if (!ev->len)
+            continue;
+          for (i = 0; i < si->n_watch_wds; i++)
             {
-              if (name)
-                fprintf (si->out_file, "key \"%s\" ", name);
-              else
-                fprintf (si->out_file, "key %s ",
-                         si->unknown_key? si->unknown_key : "UNKNOWN");
-              irpacket_printf (si->out_file, k);
-              fprintf (si->out_file, "\n");
-              fflush (si->out_file);
+              const char *base = strrchr (cfg->sources[i], '/');
+              base = base ? base + 1 : cfg->sources[i];
+              if (si->watch_wds[i] == ev->wd && !strcmp (base, ev->name))
+                {
+                  if (si->verbose)
+                    fprintf (stdout, "Config file '%s' changed\n",
+                             cfg->sources[i]);
+                  connection_set_deadline (n, CONFIG_SETTLE_TIME);
+                }
             }
-          if (name)
-            receive_button (si, n, name);
-          else if (si->verbose)
-            fprintf (stdout, "Unknown packet\n");
         }
     }
-  else
+  errno = 0;
+}
+
+static void
+timeout_watch (Connection * n, void *h)
+{
+  config_reload ((IRServerInfo *)h);
+}
+
+static void
+config_watch_start (IRServerInfo *si, Config *cfg)
+{
+  si->watch_fd = inotify_init ();
+  if (si->watch_fd < 0)
     {
-      if (si->verbose)
-        fprintf (stdout, "Closed IR connection\n");
-      close (fd);
-      if (si->irdev != n)
-        fatal (0, "can_read_ir(n): n != si->irdev");
-      si->irdev = NULL;
-      connection_remove (n);
+      warning ("Can't watch the config for changes\n");
+      errno = 0;
+      return;
     }
+  fcntl (si->watch_fd, F_SETFL, fcntl (si->watch_fd, F_GETFL) | O_NONBLOCK);
+  fcntl (si->watch_fd, F_SETFD, FD_CLOEXEC);
+  si->watch = new_connection (si->server, si->watch_fd, "config watch", si);
+  connection_set_can_read (si->watch, can_read_watch);
+  connection_set_timeout (si->watch, timeout_watch);
+  config_watch (si, cfg);
+}
+#else
+static void
+config_watch (IRServerInfo *si, Config *cfg)
+{
 }
 
-void
-timeout_ir (Connection * n, void *h)
+static void
+config_watch_start (IRServerInfo *si, Config *cfg)
 {
-  IRServerInfo *si = (IRServerInfo *)h;
-  IRPacket *k = irstate_timeout (si->ir);
+}
+#endif
 
-  if (k)
-    {
-      const char *name;
-      fprintf (stdout, "Received IR packet on timeout: ");
-      irpacket_printf (stdout, k);
-      fprintf (stdout, "\n");
-      irpacket_render (stdout, k);
-      fprintf (stdout, "\n");
-      name = irdict_lookup_packet (si->buttondict, k);
-      if (si->out_file)
-        {
-          if (name)
-            fprintf (si->out_file, "key \"%s\" ", name);
-          else
-            fprintf (si->out_file, "key %s ",
-                     si->unknown_key? si->unknown_key : "UNKNOWN");
+/* Free the strings load_config put in OPTS, a copy of GIVEN */
+static void
+config_free_opts (ServerOpts *opts, const ServerOpts *given)
+{
+  if (opts->irdev != given->irdev)
+    free (opts->irdev);
+  if (opts->frontend_host != given->frontend_host)
+    free (opts->frontend_host);
+  if (opts->out_file != given->out_file)
+    free (opts->out_file);
+  if (opts->vlc_host != given->vlc_host)
+    free (opts->vlc_host);
+  if (opts->uinput_dev != given->uinput_dev)
+    free (opts->uinput_dev);
+  if (opts->buttondict_fname != given->buttondict_fname)
+    free (opts->buttondict_fname);
+}
 
-          irpacket_printf (si->out_file, k);
-          fprintf (si->out_file, " # on timeout\n");
-          fflush (si->out_file);
-        }
-      if (name)
-        {
-          fprintf (stdout, "Button name '%s'\n", name);
-          receive_button (si, n, name);
-        }
-      else
-        {
-          fprintf (stdout, "Unknown packet\n");
-        }
+/* Load and compile CFG as load_config and keymaps_compile do, but if
+   the config has errors return false with the message in ERROR rather
+   than exit */
+static bool
+config_try_load (ServerOpts *opts, Config *cfg, char *error, size_t size)
+{
+  FatalTrap trap;
+  Lexer *mark = lexer_newest ();
+  if (setjmp (trap.env))
+    {
+      fatal_trap = trap.outer;
+      snprintf (error, size, "%s", fatal_buffer);
+      error[strcspn (error, "\n")] = '\0';
+      lexer_close_newer (mark);
+      if (opts->cache)
+        config_cache_abort (opts);
+      return false;
     }
-    /* Reset last button and repeat timer */
-    si->last_button = NULL;
-    ir_repeat_delay = 0;
+  trap.outer = fatal_trap;
+  fatal_trap = &trap;
+  load_config (opts, cfg);
+  keymaps_compile (cfg);
+  fatal_trap = trap.outer;
+  return true;
+}
+
+/* Read the config again, and if it's good, switch to it. Called by the
+   event loop with si->lock held. */
+static bool
+config_reload (IRServerInfo *si)
+{
+  ServerOpts opts = *si->opts;
+  Config *cfg;
+  char error[BUFSIZ];
+  int here;
 
+  if (!opts.config_file)
+    {
+      warning ("No config file to reload\n");
+      return false;
+    }
+  /* The daemon has moved to /, but relative paths in the config are
+     from where it started */
+  here = open (".", O_RDONLY);
+  if (si->start_dir >= 0 && fchdir (si->start_dir) < 0)
+    errno = 0;
+  if (si->verbose)
+    fprintf (stdout, "Reloading config '%s'\n", opts.config_file);
+  opts.verbose = si->verbose;
+  cfg = new_config ();
+  if (!config_try_load (&opts, cfg, error, sizeof error))
+    {
+      warning ("Config '%s' has errors, keeping the current one: %s\n",
+               opts.config_file, error);
+      config_unref (cfg);
+      cfg = NULL;
+    }
+  else if (pipeline_reload (si, cfg))
+    config_watch (si, cfg);
+  else
+    {
+      config_unref (cfg);
+      cfg = NULL;
+    }
+  config_free_opts (&opts, si->opts);
+  if (here >= 0)
+    {
+      if (fchdir (here) < 0)
+        errno = 0;
+      close (here);
+    }
+  return cfg != NULL;
 }
 
 /* ------------------------------------------------------------
@@ -1659,39 +3852,12 @@ multitap_tap (IRServerInfo *si, int key)
 
 #define TRACE(x...) do { if (si->verbose) fprintf (stdout, x); } while (0)
 
-Action *find_action_for_button_in_keymap (IRServerInfo *si, const char *button,
-                                          Keymap *km)
-{
-  Action *a = NULL;
-  InheritedKeymap *ikm;
-  if (si->verbose)
-    fprintf (stdout, "Find action for '%s' in keymap '%s'\n",
-             button, km->name);
-  a = dict_get (km->mapping, button);
-  if (a)
-    return a;
-  /* Search inherited keymaps. */
-  for (ikm = km->inherit; ikm; ikm = ikm->next) {
-    if (ikm->mapname && !ikm->map)
-      {
-        ikm->map = dict_get (si->keymaps, ikm->mapname);
-        if (!ikm->map)
-          warning ("Can't find keymap '%s' (from keymap '%s')\n",
-                   ikm->mapname, km->name);
-      }
-    if (si->verbose)
-      fprintf (stdout, "Find '%s' in keymap '%s' inherited by '%s'\n",
-               button, ikm->mapname, km->name);
-    a = find_action_for_button_in_keymap (si, button, ikm->map);
-    if (a)
-      return a;
-  }
-  return NULL;
-}
-
-Action *find_action_for_button (IRServerInfo *si, const char *button)
+Action *find_action_for_button (IRServerInfo *si, int button)
 {
-  return find_action_for_button_in_keymap (si, button, si->current_keymap);
+  Keymap *km = si->current_keymap;
+  if (!km || button < 0 || button >= km->n_table)
+    return NULL;
+  return km->table[button];
 }
 
 void server_action (IRServerInfo *si, Action *a)
@@ -1711,14 +3877,17 @@ void server_action (IRServerInfo *si, Action *a)
         mythremote_command (si, a->operand);
         break;
       case action_transmit:
-        transmit_button (si, a->operand);
+        transmit_button (si, a->button, a->repeat);
         break;
       case action_set_keymap:
-        si->current_keymap = dict_get (si->keymaps, a->operand);
+        if (!a->keymap)
+          {
+            warning ("Cannot find keymap '%s'\n", a->operand);
+            break;
+          }
+        si->current_keymap = a->keymap;
         if (si->verbose)
           fprintf (stdout, "Setting keymap to '%s'\n", a->operand);
-        if (!si->current_keymap)
-          fatal (0, "Cannot find keymap '%s'\n", a->operand);
         break;
       case action_vlc:
         vlc_command(si, a->operand);
@@ -1726,8 +3895,29 @@ void server_action (IRServerInfo *si, Action *a)
       case action_applescript:
         osascript (a->operand);
         break;
+      case action_shell:
+        {
+          /* Hand the command to eval as one quoted word, so a stray
+             quote or brace in it can't swallow the lines after it.
+             It runs in a subshell of its own, which a syntax error or
+             an exit only ends, in the background and off the helper's
+             stdin; the done mark follows it. Shell commands don't
+             wait for each other. */
+          const char *s;
+          char *buffer = malloc (4 * strlen (a->operand) + 64);
+          char *p = buffer + sprintf (buffer, "( ( eval '");
+          for (s = a->operand; *s; s++)
+            if (*s == '\'')
+              p += sprintf (p, "'\\''");
+            else
+              *p++ = *s;
+          sprintf (p, "' ) </dev/null; echo " HELPER_DONE_MARK " ) &");
+          command_helper_run (si->shell, buffer);
+          free (buffer);
+          break;
+        }
       case action_key_action:
-        handle_button(si, a->operand);
+        handle_button (si, a->button);
         break;
       }
     /* Next action in sequence */
@@ -1739,11 +3929,12 @@ void server_action (IRServerInfo *si, Action *a)
 /* This is the biggie. Decode commands and map them to actions.
  */
 bool
-handle_button (IRServerInfo *si, const char *button)
+handle_button (IRServerInfo *si, int button)
 {
   Action *a;
+  const char *name = irdict_name (si->config->buttondict, button);
   if (si->verbose)
-    fprintf (stdout, "Got button press '%s'\n", button);
+    fprintf (stdout, "Got button press '%s'\n", name);
   a = find_action_for_button (si, button);
   if (a)
     {
@@ -1753,7 +3944,7 @@ handle_button (IRServerInfo *si, const char *button)
   else
     {
       TRACE ("Cannot find button '%s' via keymap\n",
-             button);
+             name);
     }
   return false;
 }
@@ -1767,6 +3958,7 @@ idle (Connection * n, void *h)
   fflush (stdout);
   if (!cs[i])
     i = 0;
+  connection_set_deadline (n, ir_packet_timeout);
 }
 
 int
@@ -1779,32 +3971,45 @@ main_server (ServerOpts * opts)
 
   gettimeofday (&last_check, NULL);
 
+  /* Peers that go away are noticed by write errors and end-of-file */
+  signal (SIGPIPE, SIG_IGN);
+
   si = new_irserverinfo ();
   si->server = new_server (si);
-  si->buttondict = new_irdict ();
   si->ir = new_irstate ();
 
-  if (opts->config_file)
-    read_config (opts, si, opts->config_file);
+  /* The options as given, for reloads */
+  si->opts = malloc (sizeof *si->opts);
+  *si->opts = *opts;
+  si->start_dir = open (".", O_RDONLY);
+  if (si->start_dir >= 0)
+    fcntl (si->start_dir, F_SETFD, FD_CLOEXEC);
+  errno = 0;
+
+  si->config = new_config ();
+  load_config (opts, si->config);
+  action_set_tuning (&si->config->tuning);
 
   {
-    DictEntry *kmde;
-    for (kmde = dict_first(si->keymaps); kmde; kmde = dict_next(si->keymaps, kmde)) {
-      Keymap *km = kmde->value;
-      printf("Map: '%s'\n", (const char *)kmde->key);
-      dict_dumpf(km->mapping, stdout, "%s: %p");
+    int i, j;
+    for (i = 0; i < si->config->n_keymaps; i++) {
+      Keymap *km = si->config->keymaps[i];
+      printf("Map: '%s'\n", km->name);
+      for (j = 0; j < km->n_keys; j++)
+        printf("%s: %p\n", km->keys[j].button, (void *)km->keys[j].actions);
     }
   }
 
 
   si->verbose = opts->verbose;
-  server_set_timeout (si->server, ir_packet_timeout);
-
-  /* Read in a button dictionary if provided */
-  if (opts->buttondict_fname)
-    {
-      read_buttondict (opts, si, opts->buttondict_fname);
-    }
+  /* Wake up at least once a second for the reconnect checks in the
+     main loop. */
+  server_set_timeout (si->server, 1000000);
+
+  keymaps_compile (si->config);
+  si->current_keymap = si->config->last_keymap;
+  decode_set_config (si, si->config);
+  config_watch_start (si, si->config);
   if (si->verbose)
     {
       Connection *idler;
@@ -1813,6 +4018,7 @@ main_server (ServerOpts * opts)
         {
           idler = new_connection (si->server, 0, "idler", si);
 	  connection_set_timeout(idler, idle);
+          connection_set_deadline (idler, ir_packet_timeout);
         }
 
       fprintf (stdout, "cmdport: %d\n", opts->cmdport);
@@ -1821,7 +4027,7 @@ main_server (ServerOpts * opts)
       fprintf (stdout, "frontend_port: %d\n", opts->frontend_port);
 
       fprintf (stdout, "IR symbol dictionary\n");
-      for (m = si->buttondict->first; m; m = m->next)
+      for (m = si->config->buttondict->first; m; m = m->next)
         {
           fprintf (stdout, "keycode %s ", m->name);
           irpacket_printf (stdout, m->packet);
@@ -1847,6 +4053,7 @@ main_server (ServerOpts * opts)
       irdev = new_connection (si->server, fd, "irdev", si);
       connection_set_can_read (irdev, can_read_ir);
       connection_set_timeout (irdev, timeout_ir);
+      connection_set_write_error (irdev, write_error_ir);
       si->irdev = irdev;
     }
 
@@ -1906,6 +4113,23 @@ main_server (ServerOpts * opts)
     opts->verbose = false;
   }
 
+  /* Long-lived helpers for actions, started on first use (so after
+     we've daemonised) */
+  {
+    static char *osascript_argv[] = { "osascript", "-i", NULL };
+    static char *shell_argv[] = { "/bin/sh", NULL };
+    si->osascript = new_command_helper (si->server, "osascript",
+                                        osascript_argv,
+                                        "\"" HELPER_DONE_MARK "\"");
+    osascript_use_helper (si->osascript);
+    si->shell = new_command_helper (si->server, "shell", shell_argv,
+                                    NULL);
+  }
+
+  pipeline_start (si);
+  reload_wake_fd = si->wake_fd[1];
+  signal (SIGHUP, sighup_handler);
+
   /* Main loop */
   for (;;)
     {
@@ -1939,8 +4163,12 @@ main_server (ServerOpts * opts)
 void
 help (const char *argv0)
 {
-  fprintf (stdout, ("Syntax: %s [-t] [-f config_file] [-i device]"
-                    " [-p cmdport] [-h frontend] [-d]\n"), argv0);
+  fprintf (stdout, ("Syntax: %s [-t] [-f config_file] [-k cache | -K]"
+                    " [-i device] [-p cmdport] [-h frontend] [-d]\n"
+                    "       %s [-j threads] -a packet_file...\n"
+                    "       %s -c capture packet_file...\n"
+                    "       %s -C packet_file...\n"),
+           argv0, argv0, argv0, argv0);
   exit (0);
 }
 
@@ -1949,6 +4177,7 @@ main (int argc, char *argv[])
 {
   int i;
   char *c;
+  bool no_cache = false;
   ServerOpts opts;
   opts.config_file = NULL;
   opts.irdev = NULL;
@@ -1962,6 +4191,8 @@ main (int argc, char *argv[])
   opts.uinput_dev = NULL;
   opts.buttondict_fname = NULL;
   opts.daemon = false;
+  opts.cache_file = NULL;
+  opts.cache = NULL;
 
   for (i = 1; i < argc; i++)
     {
@@ -1971,8 +4202,27 @@ main (int argc, char *argv[])
             {
             case 'a':
               /* Analyse packet files */
-              analyse_packet_files (argc - (i + 1), &argv[i + i]);
+              analyse_packet_files (argc - (i + 1), &argv[i + 1]);
               return 0;
+            case 'c':
+              /* Convert packet files to a binary capture */
+              if (i + 1 >= argc)
+                help (argv[0]);
+              return convert_captures (argv[i + 1], argc - (i + 2),
+                                       &argv[i + 2]);
+            case 'C':
+              /* Convert packet files to text */
+              return convert_captures (NULL, argc - (i + 1), &argv[i + 1]);
+            case 'j':          /* -j <analysis threads> */
+              if (argv[i][2])
+                analysis_threads = atoi (&argv[i][2]);
+              else if (++i < argc)
+                analysis_threads = atoi (argv[i]);
+              else
+                help (argv[0]);
+              if (analysis_threads < 1)
+                analysis_threads = 1;
+              break;
             case 't':
               /* Test mode */
               return test_main (argc - (i + 1), &argv[i + 1]);
@@ -1989,6 +4239,18 @@ main (int argc, char *argv[])
               else
                 help (argv[0]);
               break;
+            case 'k':          /* -k <config cache> */
+              if (argv[i][2])
+                opts.cache_file = &argv[i][2];
+              else if (++i < argc)
+                opts.cache_file = argv[i];
+              else
+                help (argv[0]);
+              no_cache = false;
+              break;
+            case 'K':          /* no config cache */
+              no_cache = true;
+              break;
             case 'i':          /* -i <ir device> */
               if (argv[i][2])
                 opts.irdev = &argv[i][2];
@@ -2037,5 +4299,13 @@ main (int argc, char *argv[])
           help (argv[0]);
         }
     }
+  /* The config cache lives beside the config by default */
+  if (no_cache)
+    opts.cache_file = NULL;
+  else if (!opts.cache_file && opts.config_file)
+    {
+      opts.cache_file = malloc (strlen (opts.config_file) + 7);
+      sprintf (opts.cache_file, "%s.cache", opts.config_file);
+    }
   return main_server (&opts);
 }
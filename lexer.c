@@ -0,0 +1,236 @@
+/* ------------------------------------------------------------
+ * Lexer
+ * Files are mapped and tokenised in place, so reading a token costs
+ * no allocation; callers copy out the ones they keep.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "error.h"
+#include "lexer.h"
+
+/* Open lexers, newest first */
+static __thread Lexer *open_lexers;
+
+Lexer *
+new_lexer (const char *fname, const char *text, size_t size)
+{
+  Lexer *lx = malloc (sizeof *lx);
+  lx->fname = strdup (fname);
+  lx->text = text;
+  lx->size = size;
+  lx->pos = 0;
+  lx->line = 1;
+  lx->line_start = 0;
+  lx->mapped = false;
+  lx->next_open = open_lexers;
+  open_lexers = lx;
+  return lx;
+}
+
+Lexer *
+lexer_open (const char *file)
+{
+  Lexer *lx;
+  struct stat st;
+  void *map = NULL;
+  int fd = open (file, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st))
+    {
+      close (fd);
+      return NULL;
+    }
+  if (st.st_size)
+    {
+      map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+        {
+          close (fd);
+          return NULL;
+        }
+      madvise (map, st.st_size, MADV_SEQUENTIAL);
+    }
+  close (fd);
+  lx = new_lexer (file, map ? map : "", st.st_size);
+  lx->mapped = map != NULL;
+  return lx;
+}
+
+void
+lexer_close (Lexer * lx)
+{
+  Lexer **p;
+  for (p = &open_lexers; *p; p = &(*p)->next_open)
+    if (*p == lx)
+      {
+        *p = lx->next_open;
+        break;
+      }
+  if (lx->mapped)
+    munmap ((void *) lx->text, lx->size);
+  free ((char *) lx->fname);
+  free (lx);
+}
+
+Lexer *
+lexer_newest (void)
+{
+  return open_lexers;
+}
+
+void
+lexer_close_newer (Lexer * mark)
+{
+  while (open_lexers && open_lexers != mark)
+    lexer_close (open_lexers);
+}
+
+bool
+lexer_next (Lexer * lx, Token * t)
+{
+  const char *text = lx->text;
+
+  /* White space and comments */
+  while (lx->pos < lx->size)
+    {
+      unsigned char ch = text[lx->pos];
+      if (ch == '#')
+        while (lx->pos < lx->size && text[lx->pos] != '\n')
+          lx->pos++;
+      else if (ch == '\n')
+        {
+          lx->line++;
+          lx->line_start = ++lx->pos;
+        }
+      else if (isspace (ch))
+        lx->pos++;
+      else
+        break;
+    }
+  if (lx->pos == lx->size)
+    return false;
+
+  t->line = lx->line;
+  t->column = lx->pos - lx->line_start + 1;
+  t->quoted = text[lx->pos] == '"' || text[lx->pos] == '\'';
+  if (t->quoted)
+    {
+      char quote = text[lx->pos++];
+      size_t start = lx->pos;
+      while (lx->pos < lx->size && text[lx->pos] != quote)
+        if (text[lx->pos++] == '\n')
+          {
+            lx->line++;
+            lx->line_start = lx->pos;
+          }
+      if (lx->pos == lx->size)
+        lexer_fatal (lx, t, "Unterminated string");
+      t->text = text + start;
+      t->len = lx->pos++ - start;
+      return true;
+    }
+  t->text = text + lx->pos;
+  while (lx->pos < lx->size && !isspace ((unsigned char) text[lx->pos]))
+    lx->pos++;
+  t->len = text + lx->pos - t->text;
+  return true;
+}
+
+void
+lexer_expect (Lexer * lx, Token * t, const char *what)
+{
+  if (!lexer_next (lx, t))
+    lexer_fatal (lx, NULL, "Expected %s, got end of file", what);
+}
+
+void
+lexer_fatal (Lexer * lx, const Token * t, const char *fmt, ...)
+{
+  va_list ap;
+  size_t n = 0;
+  if (lx)
+    n = snprintf (fatal_buffer, sizeof fatal_buffer, "%s:%d:%d: ",
+                  lx->fname, t ? t->line : lx->line,
+                  t ? t->column : (int) (lx->pos - lx->line_start) + 1);
+  if (n < sizeof fatal_buffer)
+    {
+      va_start (ap, fmt);
+      vsnprintf (fatal_buffer + n, sizeof fatal_buffer - n, fmt, ap);
+      va_end (ap);
+    }
+  errno = 0;
+  fatal_die (0, fatal_buffer);
+  exit (0);
+}
+
+void
+lexer_warning (Lexer * lx, const Token * t, const char *fmt, ...)
+{
+  va_list ap;
+  fprintf (stderr, "Warning: ");
+  if (lx)
+    fprintf (stderr, "%s:%d:%d: ", lx->fname, t ? t->line : lx->line,
+             t ? t->column : (int) (lx->pos - lx->line_start) + 1);
+  va_start (ap, fmt);
+  vfprintf (stderr, fmt, ap);
+  va_end (ap);
+  fprintf (stderr, "\n");
+}
+
+bool
+token_integer (const Token * t, int base, long long *n)
+{
+  char buffer[32], *end;
+  if (!t->len || t->len >= (int) sizeof buffer)
+    return false;
+  token_copy (t, buffer, sizeof buffer);
+  errno = 0;
+  *n = strtoll (buffer, &end, base);
+  if (*end || errno)
+    {
+      errno = 0;
+      return false;
+    }
+  return true;
+}
+
+long long
+lexer_integer (Lexer * lx, const Token * t, int base)
+{
+  long long n;
+  if (!token_integer (t, base, &n))
+    lexer_fatal (lx, t, "Expected a number, got '%.*s'", t->len, t->text);
+  return n;
+}
+
+bool
+token_is (const Token * t, const char *s)
+{
+  return !strncmp (t->text, s, t->len) && !s[t->len];
+}
+
+char *
+token_strdup (const Token * t)
+{
+  return strndup (t->text, t->len);
+}
+
+char *
+token_copy (const Token * t, char *buffer, size_t size)
+{
+  size_t len = (size_t) t->len < size ? (size_t) t->len : size - 1;
+  memcpy (buffer, t->text, len);
+  buffer[len] = '\0';
+  return buffer;
+}
@@ -0,0 +1,77 @@
+/* Tokens of config, button dictionary and text capture files */
+#ifndef __lexer_h
+#define __lexer_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct Lexer Lexer;
+typedef struct Token Token;
+
+/* A token is a word ending at white space, or a string in single or
+   double quotes. A '#' where a token would start comments out the
+   rest of the line. */
+struct Token
+{
+  const char *text;             /* in the lexer's text, not terminated */
+  int len;
+  int line, column;             /* from 1 */
+  bool quoted;
+};
+
+struct Lexer
+{
+  const char *fname;
+  const char *text;
+  size_t size;
+  size_t pos;
+  int line;
+  size_t line_start;            /* of the current line */
+  bool mapped;                  /* text is lexer_open's map of fname */
+  Lexer *next_open;             /* see lexer_newest */
+};
+
+/* Map FILE, or return NULL with errno set if it can't be read */
+extern Lexer *lexer_open (const char *file);
+
+/* Tokens of the SIZE bytes at TEXT, which must outlive the lexer.
+   FNAME is only for messages. */
+extern Lexer *new_lexer (const char *fname, const char *text, size_t size);
+extern void lexer_close (Lexer * lx);
+
+/* The lexer most recently opened on this thread and not yet closed,
+   or NULL. After a FatalTrap, lexer_close_newer (MARK) closes the ones
+   abandoned since lexer_newest returned MARK. */
+extern Lexer *lexer_newest (void);
+extern void lexer_close_newer (Lexer * mark);
+
+/* The next token, or false at the end of the text */
+extern bool lexer_next (Lexer * lx, Token * t);
+
+/* The next token, which must be there: WHAT describes it */
+extern void lexer_expect (Lexer * lx, Token * t, const char *what);
+
+/* Die with a message prefixed by "file:line:column: ", for T or for
+   the current position if T is NULL. With no LX there's no prefix. */
+extern void lexer_fatal (Lexer * lx, const Token * t, const char *fmt, ...)
+  __attribute__ ((format (printf, 3, 4), noreturn));
+
+/* Warn, with the same prefix as lexer_fatal, and carry on */
+extern void lexer_warning (Lexer * lx, const Token * t, const char *fmt, ...)
+  __attribute__ ((format (printf, 3, 4)));
+
+/* The integer T spells in BASE, as strtoll(). Anything else is
+   fatal. */
+extern long long lexer_integer (Lexer * lx, const Token * t, int base);
+
+/* As lexer_integer, but return false if T isn't an integer */
+extern bool token_integer (const Token * t, int base, long long *n);
+
+extern bool token_is (const Token * t, const char *s);
+extern char *token_strdup (const Token * t);
+
+/* T as a string in BUFFER, truncated to fit. For keywords and the
+   like, which are short. */
+extern char *token_copy (const Token * t, char *buffer, size_t size);
+
+#endif  /* __lexer_h */
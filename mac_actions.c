@@ -12,6 +12,7 @@
 #include "mac_actions.h"
 #include "error.h"
 #include "dict.h"
+#include "helper.h"
 
 #define MAC_KEYS                                \
   KEY(0, 0x00, ANSI_A)                          \
@@ -145,9 +146,51 @@ static int decode_key_name (const char *name)
   return dict_decode (&d, decode_keys, name);
 }
 
+static CommandHelper *osascript_helper;
+
+void osascript_use_helper (CommandHelper *c)
+{
+  osascript_helper = c;
+}
+
+/* Run an AppleScript statement in the helper if there is one, else in
+   an osascript of its own and wait for it. The helper runs statements
+   in order. */
 void osascript(const char *cmd)
 {
-  int cpid = fork();
+  int cpid;
+  if (osascript_helper)
+    {
+      /* "osascript -i" reads a line at a time and would wait forever
+         on an unfinished tell block, so send the statement as a
+         string literal for run script, all on one line */
+      const char *s;
+      char *buffer = malloc (2 * strlen (cmd) + 32);
+      char *p = buffer + sprintf (buffer, "run script \"");
+      for (s = cmd; *s; s++)
+        switch (*s)
+          {
+          case '"':
+          case '\\':
+            *p++ = '\\';
+            *p++ = *s;
+            break;
+          case '\n':
+            p += sprintf (p, "\\n");
+            break;
+          case '\r':
+            p += sprintf (p, "\\r");
+            break;
+          default:
+            *p++ = *s;
+          }
+      strcpy (p, "\"");
+      fprintf (stdout, "osascript: '%s'\n", cmd);
+      command_helper_run (osascript_helper, buffer);
+      free (buffer);
+      return;
+    }
+  cpid = fork();
   if (cpid == -1) {
     fatal(0, "Couldn't fork");
   } else if (cpid != 0) {
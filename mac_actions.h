@@ -5,8 +5,13 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#include "helper.h"
+
 extern void osascript(const char *cmd);
 
+/* Send osascript commands to C, an "osascript -i", from now on */
+extern void osascript_use_helper (CommandHelper *c);
+
 /* Mac key.
  * Parameter is a string of the form:
  * <modifiers><name>
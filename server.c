@@ -1,7 +1,18 @@
 /* ------------------------------------------------------------
  * Server/Connection management
- * XXX TODO: handle timeouts better. Set time?
+ * Each connection can arm its own deadline (CLOCK_MONOTONIC); the
+ * armed connections are kept in a min-heap on the server, which bounds
+ * the wait in server_select and fires expired timeouts whether or not
+ * there was other I/O.
+ *
+ * Two backends: epoll on Linux, where interest is registered when the
+ * callbacks are set and updated incrementally, and select() everywhere
+ * else (or when built with -DNO_EPOLL).
  */
+#if __linux__ && !defined(NO_EPOLL)
+#define USE_EPOLL
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,10 +31,25 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "error.h"
 #include "server.h"
 
+/* Outgoing data is queued in a chain of these */
+typedef struct ConnectionBuffer ConnectionBuffer;
+struct ConnectionBuffer
+{
+  ConnectionBuffer *next;
+  int start, end;               /* unwritten data is data[start..end) */
+  char data[BUFSIZ];
+};
+
 struct Connection
 {
   Server *server;
@@ -35,8 +61,30 @@ struct Connection
   void (*can_read) (Connection * n, void *h);
   void (*except) (Connection * n, void *h);
   void (*timeout) (Connection * n, void *h);
+  void (*write_error) (Connection * n, void *h);
 
   void *h;
+
+  /* Output queue */
+  ConnectionBuffer *out_first;
+  ConnectionBuffer *out_last;
+  int out_bytes;
+  int write_limit;              /* max out_bytes, 0 for unlimited */
+  ConnectionOverflow overflow;  /* what to do beyond write_limit */
+  bool write_failed;            /* peer dropped; discard output */
+  bool error_queued;            /* on the server's write_errors list */
+  Connection *next_error;
+
+  long long deadline;           /* usecs, CLOCK_MONOTONIC */
+  int heap_index;               /* index in server timer heap, or -1 */
+  Connection *next_expired;
+  bool removed;                 /* freed at the end of server_select */
+  Connection *next_removed;
+
+#ifdef USE_EPOLL
+  unsigned events;              /* events registered with epoll */
+  bool always_ready;            /* fd can't be polled (regular file) */
+#endif
 };
 
 
@@ -44,8 +92,23 @@ struct Server
 {
   Connection *first;
   Connection *last;
-  struct timeval timeout;
+  struct timeval timeout;        /* longest wait in server_select */
   void *h;
+  pthread_mutex_t *lock;        /* released while waiting, or NULL */
+
+  /* Timer min-heap, ordered by deadline */
+  Connection **timers;
+  int n_timers;
+  int n_timers_allocated;
+
+  bool dispatching;             /* inside server_select callbacks */
+  Connection *removed;          /* connections to free after dispatch */
+  Connection *write_errors;     /* write_error callbacks to run */
+
+#ifdef USE_EPOLL
+  int epoll_fd;
+  int n_always_ready;
+#endif
 };
 
 Server *
@@ -55,9 +118,216 @@ new_server (void *h)
   v->first = NULL;
   v->last = NULL;
   v->h = h;
+  v->lock = NULL;
+  v->timeout.tv_sec = 1;
+  v->timeout.tv_usec = 0;
+  v->n_timers_allocated = 8;
+  v->n_timers = 0;
+  v->timers = malloc (v->n_timers_allocated * sizeof *v->timers);
+  v->dispatching = false;
+  v->removed = NULL;
+  v->write_errors = NULL;
+#ifdef USE_EPOLL
+  v->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (v->epoll_fd < 0)
+    fatal (0, "Couldn't create epoll instance");
+  v->n_always_ready = 0;
+#endif
   return v;
 }
 
+/* ------------------------------------------------------------
+ * Timers
+ */
+
+static long long
+now_usecs (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+timer_heap_set (Server * v, int i, Connection * n)
+{
+  v->timers[i] = n;
+  n->heap_index = i;
+}
+
+static void
+timer_heap_up (Server * v, int i)
+{
+  Connection *n = v->timers[i];
+  while (i > 0)
+    {
+      int parent = (i - 1) / 2;
+      if (v->timers[parent]->deadline <= n->deadline)
+        break;
+      timer_heap_set (v, i, v->timers[parent]);
+      i = parent;
+    }
+  timer_heap_set (v, i, n);
+}
+
+static void
+timer_heap_down (Server * v, int i)
+{
+  Connection *n = v->timers[i];
+  for (;;)
+    {
+      int child = 2 * i + 1;
+      if (child >= v->n_timers)
+        break;
+      if (child + 1 < v->n_timers
+          && v->timers[child + 1]->deadline < v->timers[child]->deadline)
+        child++;
+      if (n->deadline <= v->timers[child]->deadline)
+        break;
+      timer_heap_set (v, i, v->timers[child]);
+      i = child;
+    }
+  timer_heap_set (v, i, n);
+}
+
+static void
+timer_heap_remove (Server * v, Connection * n)
+{
+  int i = n->heap_index;
+  Connection *last;
+  if (i < 0)
+    return;
+  n->heap_index = -1;
+  last = v->timers[--v->n_timers];
+  if (last == n)
+    return;
+  timer_heap_set (v, i, last);
+  timer_heap_up (v, i);
+  timer_heap_down (v, last->heap_index);
+}
+
+/* Arm N's deadline TIMEOUT usecs from now, replacing any previous
+   deadline. A negative TIMEOUT disarms it. */
+void
+connection_set_deadline (Connection * n, int timeout)
+{
+  Server *v = n->server;
+  timer_heap_remove (v, n);
+  if (timeout < 0)
+    return;
+  n->deadline = now_usecs () + timeout;
+  if (v->n_timers == v->n_timers_allocated)
+    {
+      v->n_timers_allocated *= 2;
+      v->timers = realloc (v->timers,
+                           v->n_timers_allocated * sizeof *v->timers);
+    }
+  timer_heap_set (v, v->n_timers++, n);
+  timer_heap_up (v, n->heap_index);
+}
+
+/* How long server_select may wait, in usecs */
+static long long
+server_wait_usecs (Server * v)
+{
+  long long wait = v->timeout.tv_sec * 1000000LL + v->timeout.tv_usec;
+  if (v->n_timers)
+    {
+      long long until = v->timers[0]->deadline - now_usecs ();
+      if (until < 0)
+        until = 0;
+      if (until < wait)
+        wait = until;
+    }
+  return wait;
+}
+
+/* Fire every timeout whose deadline has passed. Deadlines are one-shot;
+   callbacks may re-arm them, and re-armed timers wait for the next
+   pass. */
+static void
+server_run_timers (Server * v)
+{
+  long long now = now_usecs ();
+  Connection *expired = NULL, **tail = &expired, *n;
+
+  while (v->n_timers && v->timers[0]->deadline <= now)
+    {
+      n = v->timers[0];
+      timer_heap_remove (v, n);
+      n->next_expired = NULL;
+      *tail = n;
+      tail = &n->next_expired;
+    }
+  while (expired)
+    {
+      n = expired;
+      expired = n->next_expired;
+      if (n->timeout && !n->removed)
+        n->timeout (n, n->h);
+    }
+}
+
+#ifdef USE_EPOLL
+/* Bring the epoll registration for N in line with its callbacks */
+static void
+connection_update_events (Connection * n)
+{
+  Server *v = n->server;
+  struct epoll_event ev;
+  unsigned events = 0;
+  int op;
+
+  if (n->can_read)
+    events |= EPOLLIN;
+  if (n->can_write || n->out_first)
+    events |= EPOLLOUT;
+  if (n->except)
+    events |= EPOLLPRI;
+  if (events == n->events)
+    return;
+
+  if (n->always_ready)
+    {
+      /* Not in the epoll set; just track whether it's active */
+      if (events && !n->events)
+        v->n_always_ready++;
+      else if (!events && n->events)
+        v->n_always_ready--;
+      n->events = events;
+      return;
+    }
+
+  if (!events)
+    op = EPOLL_CTL_DEL;
+  else if (!n->events)
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+  memset (&ev, '\0', sizeof ev);
+  ev.events = events;
+  ev.data.ptr = n;
+  if (epoll_ctl (v->epoll_fd, op, n->fd, &ev) < 0)
+    {
+      if (op == EPOLL_CTL_ADD && errno == EPERM)
+        {
+          /* Regular files and the like are always readable/writable
+             and epoll refuses them. Poll them on every pass. */
+          errno = 0;
+          n->always_ready = true;
+          n->events = 0;
+          connection_update_events (n);
+          return;
+        }
+      fatal (0, "Couldn't update epoll interest for connection '%s'", n->id);
+    }
+  n->events = events;
+}
+#else
+/* select() rebuilds its fd_sets on every pass */
+#define connection_update_events(n) ((void) 0)
+#endif
+
 Connection *
 new_connection (Server * v, int fd, char *id, void *h)
 {
@@ -74,6 +344,29 @@ new_connection (Server * v, int fd, char *id, void *h)
   n->can_read = NULL;
   n->except = NULL;
   n->timeout = NULL;
+  n->write_error = NULL;
+  n->out_first = NULL;
+  n->out_last = NULL;
+  n->out_bytes = 0;
+  n->write_limit = 0;
+  n->overflow = overflow_disconnect;
+  n->write_failed = false;
+  n->error_queued = false;
+  n->next_error = NULL;
+  n->deadline = 0;
+  n->heap_index = -1;
+  n->next_expired = NULL;
+  n->removed = false;
+  n->next_removed = NULL;
+#ifdef USE_EPOLL
+  n->events = 0;
+  n->always_ready = false;
+  /* A child still holding the fd would keep it in the epoll set after
+     it's closed here, and its events would name a freed Connection */
+  if (fd > 2)
+    fcntl (fd, F_SETFD, fcntl (fd, F_GETFD) | FD_CLOEXEC);
+  errno = 0;
+#endif
   if (!v->first)
     v->first = n;
   v->last = n;
@@ -81,6 +374,8 @@ new_connection (Server * v, int fd, char *id, void *h)
 
   return n;
 }
+static void connection_discard_output (Connection * n);
+
 void
 connection_remove (Connection * n)
 {
@@ -93,28 +388,212 @@ connection_remove (Connection * n)
     n->next->prev = n->prev;
   if (n->prev)
     n->prev->next = n->next;
+  timer_heap_remove (v, n);
+  connection_discard_output (n);
+  if (n->error_queued)
+    {
+      Connection **p;
+      for (p = &v->write_errors; *p != n; p = &(*p)->next_error)
+        ;
+      *p = n->next_error;
+      n->error_queued = false;
+    }
+#ifdef USE_EPOLL
+  /* The fd has usually been closed already, which drops it from the
+     epoll set, so a failure here is expected. */
+  if (n->events && !n->always_ready)
+    epoll_ctl (v->epoll_fd, EPOLL_CTL_DEL, n->fd, NULL);
+  else if (n->events)
+    v->n_always_ready--;
+  errno = 0;
+#endif
+  if (v->dispatching)
+    {
+      /* Events, timeouts or a loop may still reach N in this pass */
+      n->removed = true;
+      n->next_removed = v->removed;
+      v->removed = n;
+      return;
+    }
   free (n->id);
   free (n);
 }
 
+/* Run the write_error callbacks queued by connection_write_failed, and
+   then free the connections removed during dispatch */
+static void
+server_end_dispatch (Server * v)
+{
+  Connection *n;
+  while (v->write_errors)
+    {
+      n = v->write_errors;
+      v->write_errors = n->next_error;
+      n->error_queued = false;
+      if (!n->removed)
+        n->write_error (n, n->h);
+    }
+  v->dispatching = false;
+  while (v->removed)
+    {
+      n = v->removed;
+      v->removed = n->next_removed;
+      free (n->id);
+      free (n);
+    }
+}
+
+/* ------------------------------------------------------------
+ * Output queues
+ * connection_write never blocks: whatever the fd won't take right now
+ * is queued and flushed when it becomes writable.
+ */
+
+static void
+connection_discard_output (Connection * n)
+{
+  while (n->out_first)
+    {
+      ConnectionBuffer *b = n->out_first;
+      n->out_first = b->next;
+      free (b);
+    }
+  n->out_last = NULL;
+  n->out_bytes = 0;
+}
+
+/* The peer is gone or hopelessly stalled. Drop its output and shut the
+   socket down; the owner sees end-of-file on its next read and closes
+   the connection in the usual way. Anything else, such as a tty or a
+   pipe, can't be shut down, so its write_error callback is run from
+   server_select instead. */
+static void
+connection_write_failed (Connection * n)
+{
+  Server *v = n->server;
+  if (!n->write_failed)
+    warning ("Dropping output to connection '%s'\n", n->id);
+  n->write_failed = true;
+  connection_discard_output (n);
+  connection_update_events (n);
+  if (shutdown (n->fd, SHUT_RDWR) < 0 && errno == ENOTSOCK
+      && n->write_error && !n->error_queued)
+    {
+      n->error_queued = true;
+      n->next_error = v->write_errors;
+      v->write_errors = n;
+    }
+  errno = 0;
+}
+
+/* Write as much queued output as the fd will take */
+static void
+connection_flush_output (Connection * n)
+{
+  while (n->out_first)
+    {
+      ConnectionBuffer *b = n->out_first;
+      int written = write (n->fd, b->data + b->start, b->end - b->start);
+      if (written < 0)
+        {
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+              errno = 0;
+              return;
+            }
+          connection_write_failed (n);
+          return;
+        }
+      b->start += written;
+      n->out_bytes -= written;
+      if (b->start < b->end)
+        return;
+      n->out_first = b->next;
+      if (!n->out_first)
+        n->out_last = NULL;
+      free (b);
+    }
+  connection_update_events (n);
+}
+
 void
 connection_write (Connection * n, const char *data, int count)
 {
-  /* Temporarily set the connection blocking. Blugh. */
-  fcntl (n->fd, F_SETFL, fcntl (n->fd, F_GETFL) & ~O_NONBLOCK);
-  for (;;)
+  if (n->write_failed)
+    return;
+
+  /* Nothing queued: try to write it straight away */
+  while (!n->out_first && count > 0)
     {
-      int written;
-      if (count <= 0)
-        break;
-      written = write (n->fd, data, count);
+      int written = write (n->fd, data, count);
       if (written < 0)
-        fatal (0, "Couldn't write to connection '%s'", n->id);
+        {
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+              errno = 0;
+              break;
+            }
+          connection_write_failed (n);
+          return;
+        }
       count -= written;
       data += written;
     }
-  /* Set non-blocking again */
-  fcntl (n->fd, F_SETFL, fcntl (n->fd, F_GETFL) | O_NONBLOCK);
+  if (count <= 0)
+    return;
+
+  if (n->write_limit && n->out_bytes + count > n->write_limit)
+    {
+      if (n->overflow == overflow_drop)
+        {
+          warning ("Output queue full on connection '%s', dropping %d bytes\n",
+                   n->id, count);
+          return;
+        }
+      connection_write_failed (n);
+      return;
+    }
+
+  /* Queue the rest */
+  while (count > 0)
+    {
+      ConnectionBuffer *b = n->out_last;
+      int len;
+      if (!b || b->end == sizeof b->data)
+        {
+          b = malloc (sizeof *b);
+          b->next = NULL;
+          b->start = b->end = 0;
+          if (n->out_last)
+            n->out_last->next = b;
+          else
+            n->out_first = b;
+          n->out_last = b;
+        }
+      len = sizeof b->data - b->end;
+      if (len > count)
+        len = count;
+      memcpy (b->data + b->end, data, len);
+      b->end += len;
+      n->out_bytes += len;
+      data += len;
+      count -= len;
+    }
+  connection_update_events (n);
+}
+
+int
+connection_pending (Connection * n)
+{
+  return n->out_bytes;
+}
+
+void
+connection_set_write_limit (Connection * n, int limit,
+                            ConnectionOverflow overflow)
+{
+  n->write_limit = limit;
+  n->overflow = overflow;
 }
 
 Connection *
@@ -187,18 +666,90 @@ connection_port (Server * v, char *hostname, int port, void *h)
   return new_connection (v, socket_fd, buffer, h);
 }
 
+/* Other threads may change connections while holding LOCK. The
+   caller of server_select holds it, and server_select releases it
+   only while waiting for I/O. */
+void server_set_lock (Server *v, pthread_mutex_t *lock)
+{
+  v->lock = lock;
+}
+
+/* Longest time server_select waits when no deadline is nearer, in
+   usecs */
 void server_set_timeout (Server *v, int timeout)
 {
   v->timeout.tv_sec = timeout / 1000000;
   v->timeout.tv_usec = timeout % 1000000;
 }
 
+#ifdef USE_EPOLL
+/* Largest number of events handled per server_select */
+#define MAX_EVENTS 64
+
+static void
+connection_dispatch (Connection * n, unsigned events)
+{
+  if (n->removed)
+    return;
+  if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && n->out_first)
+    connection_flush_output (n);
+  if ((events & EPOLLPRI) && n->except)
+    n->except (n, n->h);
+  else if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && n->can_read)
+    n->can_read (n, n->h);
+  else if ((events & (EPOLLOUT | EPOLLERR)) && n->can_write)
+    n->can_write (n, n->h);
+}
+
+void server_select (Server * v)
+{
+  Connection *n, *next_n;
+  struct epoll_event events[MAX_EVENTS];
+  int timeout;
+  int rv, i;
+
+  if (v->first == NULL)
+    fatal (0, "Attempt to select on a Server with no connections");
+
+  if (v->n_always_ready)
+    timeout = 0;
+  else
+    timeout = (server_wait_usecs (v) + 999) / 1000;
+  if (v->lock)
+    pthread_mutex_unlock (v->lock);
+  rv = epoll_wait (v->epoll_fd, events, MAX_EVENTS, timeout);
+  if (v->lock)
+    pthread_mutex_lock (v->lock);
+  if (rv == -1)
+    {
+      if (errno == EINTR)
+        {
+          errno = 0;
+          return;
+        }
+      fatal (0, "Error in epoll_wait");
+    }
+
+  v->dispatching = true;
+  for (i = 0; i < rv; i++)
+    connection_dispatch (events[i].data.ptr, events[i].events);
+  for (n = v->first; n && v->n_always_ready; n = next_n)
+    {
+      next_n = n->next;
+      if (n->always_ready)
+        connection_dispatch (n, n->events);
+    }
+  server_run_timers (v);
+  server_end_dispatch (v);
+}
+#else
 void server_select (Server * v)
 {
   Connection *n, *next_n;
   fd_set readfds, writefds, exceptfds;
   int high_fd;
   struct timeval timeout;
+  long long wait;
   int rv;
   int count_active = 0;
 
@@ -206,51 +757,67 @@ void server_select (Server * v)
   FD_ZERO (&writefds);
   FD_ZERO (&exceptfds);
 
-  timeout = v->timeout;
+  wait = server_wait_usecs (v);
+  timeout.tv_sec = wait / 1000000;
+  timeout.tv_usec = wait % 1000000;
 
   if (v->first == NULL)
     fatal (0, "Attempt to select on a Server with no connections");
   high_fd = v->first->fd;
   for (n = v->first; n; n = n->next)
     {
-      if (!(n->can_write || n->can_read || n->except))
+      if (!(n->can_write || n->can_read || n->except || n->out_first))
         continue;
+      if (n->fd >= FD_SETSIZE)
+        fatal (0, "fd %d of connection '%s' is too large for select()",
+               n->fd, n->id);
       if (n->fd > high_fd)
         high_fd = n->fd;
       count_active++;
 
-      if (n->can_write)
+      if (n->can_write || n->out_first)
         FD_SET (n->fd, &writefds);
       if (n->can_read)
         FD_SET (n->fd, &readfds);
       if (n->except)
         FD_SET (n->fd, &exceptfds);
     }
+  if (v->lock)
+    pthread_mutex_unlock (v->lock);
   rv = select (high_fd + 1, &readfds, &writefds, &exceptfds, &timeout);
+  if (v->lock)
+    pthread_mutex_lock (v->lock);
 
   if (rv == -1)
-    fatal (0, "Error in select");
-  if (rv == 0)
     {
-      for (n = v->first; n; n = next_n)
+      if (errno == EINTR)
         {
-          next_n = n->next;
-          if (n->timeout)
-            n->timeout (n, n->h);
+          errno = 0;
+          return;
         }
+      fatal (0, "Error in select");
     }
-  else
+  v->dispatching = true;
+  if (rv > 0)
     for (n = v->first; n; n = next_n)
       {
+        /* A removed connection still links to the rest of the list */
         next_n = n->next;
-        if (FD_ISSET (n->fd, &exceptfds))
+        if (n->removed)
+          continue;
+        if (FD_ISSET (n->fd, &writefds) && n->out_first)
+          connection_flush_output (n);
+        if (FD_ISSET (n->fd, &exceptfds) && n->except)
           n->except (n, n->h);
-        else if (FD_ISSET (n->fd, &readfds))
+        else if (FD_ISSET (n->fd, &readfds) && n->can_read)
           n->can_read (n, n->h);
-        else if (FD_ISSET (n->fd, &writefds))
+        else if (FD_ISSET (n->fd, &writefds) && n->can_write)
           n->can_write (n, n->h);
       }
+  server_run_timers (v);
+  server_end_dispatch (v);
 }
+#endif
 
 int connection_fd(Connection *n)
 {
@@ -261,18 +828,27 @@ void connection_set_can_read (Connection *n,
 			      void (*can_read) (Connection * n, void *h))
 {
   n->can_read = can_read;
+  connection_update_events (n);
 }
 
 void connection_set_can_write (Connection *n,
 			       void (*can_write) (Connection * n, void *h))
 {
   n->can_write = can_write;
+  connection_update_events (n);
+}
+
+void connection_set_write_error (Connection *n,
+				 void (*write_error) (Connection * n, void *h))
+{
+  n->write_error = write_error;
 }
 
 void connection_set_except (Connection *n,
 			    void (*except) (Connection * n, void *h))
 {
   n->except = except;
+  connection_update_events (n);
 }
 
 void connection_set_timeout (Connection *n,
@@ -1,10 +1,24 @@
+/* Server/Connection management */
+#ifndef __server_h
+#define __server_h
+
+#include <pthread.h>
+
 typedef struct Connection Connection;
 typedef struct Server Server;
 typedef struct Action Action;
 typedef struct Keymap Keymap;
 
+/* What connection_write does when the output queue would exceed its
+   write limit */
+typedef enum ConnectionOverflow {
+  overflow_drop,                /* drop the new data */
+  overflow_disconnect           /* drop the connection */
+} ConnectionOverflow;
+
 extern Server *new_server (void *h);
 extern void server_set_timeout (Server *v, int timeout);
+extern void server_set_lock (Server *v, pthread_mutex_t *lock);
 extern void server_select (Server * v);
 
 /* Connection constructors */
@@ -16,8 +30,12 @@ extern void connection_remove (Connection * n);
 
 extern int connection_fd (Connection *n);
 
-/* Write to connection */
+/* Write to connection. Never blocks: data the fd won't take yet is
+   queued and written when it becomes writable. */
 extern void connection_write (Connection * n, const char *data, int count);
+extern int connection_pending (Connection * n);
+extern void connection_set_write_limit (Connection * n, int limit,
+                                        ConnectionOverflow overflow);
 
 /* Modifiers */
 extern void connection_set_can_read (Connection *n,
@@ -28,3 +46,13 @@ extern void connection_set_except (Connection *n,
 				   void (*except) (Connection * n, void *h));
 extern void connection_set_timeout (Connection *n,
 				    void (*except) (Connection * n, void *h));
+/* Called from server_select once a write to a connection that isn't a
+   socket has failed; its output is dropped from then on */
+extern void connection_set_write_error (Connection *n,
+					void (*write_error) (Connection * n,
+							     void *h));
+/* Arm the timeout callback to fire TIMEOUT usecs from now (one-shot);
+   a negative TIMEOUT disarms it. */
+extern void connection_set_deadline (Connection *n, int timeout);
+
+#endif  /* __server_h */
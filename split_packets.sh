@@ -8,5 +8,5 @@ fi
 
 for key in $( awk '/^key/ { print $2 }' < "$in" | sort | uniq ); do
     echo "Key: $key "
-    grep "^key $key " "$in" | sed "s/^key $key//; s/#.*//" > "key.$key"
+    grep "^key $key " "$in" | sed "s/^key $key//; s/@[0-9]*//; s/#.*//" > "key.$key"
 done